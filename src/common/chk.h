@@ -0,0 +1,10 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+
+#define CHK(expr)                                               \
+    if (!(expr)) {                                              \
+        fprintf(stderr, "Failed at %s:%d\n", __FILE__, __LINE__); \
+        abort();                                                \
+    }
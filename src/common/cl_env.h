@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+#include <CL/cl.h>
+#include "chk.h"
+
+// First device of `type`, searching the platforms in order; nullptr if
+// there is none.
+inline cl_device_id find_device(cl_device_type type, cl_platform_id *platform = nullptr) {
+    cl_uint platform_count = 0;
+    if (clGetPlatformIDs(0, nullptr, &platform_count) != CL_SUCCESS || platform_count == 0)
+        return nullptr;
+    cl_platform_id *platforms = (cl_platform_id *) malloc(sizeof(cl_platform_id) * platform_count);
+    CHK(platforms);
+    CHK(!clGetPlatformIDs(platform_count, platforms, nullptr));
+    cl_device_id device = nullptr;
+    for (cl_uint i = 0; i < platform_count && !device; ++i) {
+        cl_uint device_count = 0;
+        if (clGetDeviceIDs(platforms[i], type, 1, &device, &device_count) != CL_SUCCESS || device_count == 0) {
+            device = nullptr;
+            continue;
+        }
+        if (platform)
+            *platform = platforms[i];
+    }
+    free(platforms);
+    return device;
+}
+
+// Platform, device, context and profiling queue shared by every launch in the
+// process, so that OpenCL setup and program builds are paid once.
+struct ClEnv {
+    cl_platform_id platform = nullptr;
+    cl_device_id device = nullptr;
+    cl_context context = nullptr;
+    cl_command_queue queue = nullptr;
+
+    explicit ClEnv(cl_device_type type = CL_DEVICE_TYPE_GPU) {
+        cl_int ret = CL_SUCCESS;
+        device = find_device(type, &platform);
+        if (!device) {
+            fprintf(stderr, "No device found!\n");
+            abort();
+        }
+
+        context = clCreateContext(nullptr, 1, &device, nullptr, nullptr, &ret);
+        CHK(context);
+        queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &ret);
+        CHK(queue);
+    }
+
+    ~ClEnv() {
+        clReleaseCommandQueue(queue);
+        clReleaseContext(context);
+    }
+
+    ClEnv(const ClEnv &) = delete;
+    ClEnv &operator=(const ClEnv &) = delete;
+};
+
+inline ClEnv &cl_env() {
+    static ClEnv env;
+    return env;
+}
+
+// Whether cl_env() has a device to open; CPU-only nodes, e.g. with PoCL
+// alone, have none and skip the GPU runs.
+inline bool has_gpu() {
+    static bool found = find_device(CL_DEVICE_TYPE_GPU) != nullptr;
+    return found;
+}
+
+// Device-side duration of a finished command enqueued on a profiling queue.
+inline double event_seconds(cl_event event) {
+    cl_ulong start = 0, end = 0;
+    CHK(!clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, nullptr));
+    CHK(!clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, nullptr));
+    return (end - start) * 1e-9;
+}
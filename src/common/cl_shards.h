@@ -0,0 +1,215 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <utility>
+#include <vector>
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <CL/cl.h>
+#include "chk.h"
+#include "cl_env.h"
+#include "kernel_cache.h"
+#include "roofline.h"
+
+// Splits a CPU OpenCL device into sub-devices, each with its own queue and
+// kernels, so one launch can be sharded across them. When the split is by
+// NUMA node, every shard's data is also placed in buffers on its own node.
+
+// Number of NUMA nodes the kernel reports online, 1 without NUMA support.
+inline int numa_node_count() {
+    FILE *online = fopen("/sys/devices/system/node/online", "r");
+    if (!online)
+        return 1;
+    int first = 0, last = 0;
+    int got = fscanf(online, "%d-%d", &first, &last);
+    fclose(online);
+    return got == 2 ? last + 1 : 1;
+}
+
+// Device buffer over host memory that prefers NUMA node `node` (any node if
+// it is negative). The pages are bound before their first touch and handed
+// over with CL_MEM_USE_HOST_PTR, which CPU devices use in place.
+struct NodeBuffer {
+    cl_mem mem = nullptr;
+    void *host = nullptr;
+    size_t bytes = 0;
+
+    NodeBuffer(cl_context context, cl_mem_flags flags, size_t bytes, int node) : bytes(bytes) {
+        host = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        CHK(host != MAP_FAILED);
+        if (node >= 0 && node < 64) {
+            // Best effort: without NUMA support the pages land anywhere
+            unsigned long mask = 1UL << node;
+            syscall(SYS_mbind, host, bytes, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0);
+        }
+        mem = clCreateBuffer(context, flags | CL_MEM_USE_HOST_PTR, bytes, host, nullptr);
+        CHK(mem);
+    }
+
+    ~NodeBuffer() {
+        clReleaseMemObject(mem);
+        munmap(host, bytes);
+    }
+
+    NodeBuffer(const NodeBuffer &) = delete;
+    NodeBuffer &operator=(const NodeBuffer &) = delete;
+};
+
+enum Partition {
+    WHOLE_DEVICE,  // a single shard, the unpartitioned baseline
+    BY_NUMA,       // one sub-device per NUMA node
+    EQUALLY,       // sub-devices of a given number of compute units
+};
+
+class ClShards {
+public:
+    cl_device_id parent = nullptr;
+    cl_context context = nullptr;
+    std::vector<cl_device_id> devices;
+    std::vector<cl_command_queue> queues;
+    std::vector<cl_uint> compute_units;
+    std::vector<int> nodes;  // NUMA node of each shard, -1 when unknown
+
+    // Partitions the first CPU device. A device that cannot be partitioned
+    // as asked is used whole, with a warning.
+    ClShards(const char *source_path, Partition partition, cl_uint units = 0) {
+        parent = find_device(CL_DEVICE_TYPE_CPU);
+        CHK(parent);
+        if (partition != WHOLE_DEVICE) {
+            cl_device_partition_property by_numa[] = {
+                CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN, CL_DEVICE_AFFINITY_DOMAIN_NUMA, 0};
+            cl_device_partition_property equally[] = {CL_DEVICE_PARTITION_EQUALLY, cl_device_partition_property(units), 0};
+            const cl_device_partition_property *properties = partition == BY_NUMA ? by_numa : equally;
+            cl_uint count = 0;
+            if (clCreateSubDevices(parent, properties, 0, nullptr, &count) == CL_SUCCESS && count > 0) {
+                devices.resize(count);
+                CHK(!clCreateSubDevices(parent, properties, count, devices.data(), nullptr));
+            } else {
+                fprintf(stderr, "CPU device cannot be partitioned %s, using it whole\n",
+                        partition == BY_NUMA ? "by NUMA node" : "equally");
+            }
+        }
+        bool by_numa = partition == BY_NUMA && !devices.empty();
+        if (devices.empty())
+            devices.push_back(parent);
+
+        // Only a NUMA split tells where a sub-device runs: they follow the
+        // node order, so with one per node the i-th runs on node i. Equal
+        // sub-devices may span nodes and get no preferred node.
+        bool one_per_node = by_numa && int(devices.size()) == numa_node_count();
+        for (size_t i = 0; i < devices.size(); ++i) {
+            cl_uint cu = 0;
+            CHK(!clGetDeviceInfo(devices[i], CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cu), &cu, nullptr));
+            compute_units.push_back(std::max(cu, 1u));
+            nodes.push_back(one_per_node ? int(i) : -1);
+        }
+
+        cl_int ret = CL_SUCCESS;
+        context = clCreateContext(nullptr, devices.size(), devices.data(), nullptr, nullptr, &ret);
+        CHK(context);
+        for (cl_device_id device : devices) {
+            cl_command_queue queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &ret);
+            CHK(queue);
+            queues.push_back(queue);
+            caches.push_back(std::make_unique<KernelCache>(context, device, source_path));
+        }
+    }
+
+    ~ClShards() {
+        caches.clear();
+        for (cl_command_queue queue : queues)
+            clReleaseCommandQueue(queue);
+        clReleaseContext(context);
+        for (cl_device_id device : devices)
+            if (device != parent)
+                clReleaseDevice(device);
+    }
+
+    ClShards(const ClShards &) = delete;
+    ClShards &operator=(const ClShards &) = delete;
+
+    size_t size() const { return devices.size(); }
+
+    // Valid until the next call for the same shard, like KernelCache::get().
+    cl_kernel kernel(size_t shard, const char *name, const Specialization &spec = {}) {
+        return caches[shard]->get(name, spec);
+    }
+
+    // [begin, end) of each shard out of n items, proportional to its compute
+    // units, with every boundary but the last a multiple of `align`.
+    std::vector<std::pair<size_t, size_t>> split(size_t n, size_t align) const {
+        size_t total = 0;
+        for (cl_uint cu : compute_units)
+            total += cu;
+        std::vector<std::pair<size_t, size_t>> ranges;
+        size_t begin = 0, units = 0;
+        for (size_t i = 0; i < size(); ++i) {
+            units += compute_units[i];
+            size_t end = i + 1 == size() ? n : std::min(n, (n * units / total + align / 2) / align * align);
+            end = std::max(begin, end);
+            ranges.push_back({begin, end});
+            begin = end;
+        }
+        return ranges;
+    }
+
+    void finish() {
+        for (cl_command_queue queue : queues)
+            CHK(!clFinish(queue));
+    }
+
+    void print() const {
+        printf("CPU device in %zu shard(s):", size());
+        for (size_t i = 0; i < size(); ++i) {
+            printf(" %u CUs", compute_units[i]);
+            if (nodes[i] >= 0)
+                printf(" on node %d", nodes[i]);
+            printf(i + 1 == size() ? "\n" : ",");
+        }
+    }
+
+private:
+    std::vector<std::unique_ptr<KernelCache>> caches;
+};
+
+// --sub-devices N: equal sub-devices of N compute units instead of one per NUMA node
+inline cl_uint sub_device_units = 0;
+
+// The whole CPU device, or the CPU device partitioned as sub_device_units
+// asks, built once per process for the program in `source_path`.
+inline ClShards &cpu_shards(const char *source_path, bool split) {
+    static ClShards whole(source_path, WHOLE_DEVICE);
+    static ClShards parts(source_path, sub_device_units ? EQUALLY : BY_NUMA, sub_device_units);
+    return split ? parts : whole;
+}
+
+// Times a launch on the whole CPU device against the same launch sharded
+// across its sub-devices. run(shards) resets the inputs, launches and
+// returns the kernel time, then check() validates the output. Both run on
+// host memory, so `roof` should be a host roof.
+template <typename Run, typename Check>
+void compare_shards(const char *name, const char *source_path, Work work, const Roof &roof, Run run, Check check) {
+    if (!find_device(CL_DEVICE_TYPE_CPU)) {
+        printf("No CPU OpenCL device, skipping the sub-device runs\n");
+        return;
+    }
+    const std::pair<const char *, bool> runs[] = {{"whole", false}, {"sub-devices", true}};
+    double whole_time = 0;
+    for (const auto &[run_name, split] : runs) {
+        ClShards &shards = cpu_shards(source_path, split);
+        shards.print();
+        double kernel_time = run(shards);
+        if (!split)
+            whole_time = kernel_time;
+        printf("%s[%s] kernel time: %lf, speedup: %.2fx\n", name, run_name, kernel_time, whole_time / kernel_time);
+        char report_name[64];
+        snprintf(report_name, sizeof(report_name), "%s[%s]", name, run_name);
+        report_roofline(report_name, kernel_time, work, roof);
+        check();
+    }
+}
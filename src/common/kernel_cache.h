@@ -0,0 +1,122 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+#include <list>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <CL/cl.h>
+#include "chk.h"
+
+// Kernel parameters baked in as compile-time constants, e.g. {{"INCX", 3}}.
+// Each entry becomes a -D<name>=<value> build option; kernels fall back to
+// their runtime arguments for anything left unset.
+using Specialization = std::map<std::string, long>;
+
+inline std::string build_options(const Specialization &spec) {
+    std::string options;
+    for (const auto &[name, value] : spec) {
+        if (!options.empty())
+            options += ' ';
+        options += "-D" + name + "=" + std::to_string(value);
+    }
+    return options;
+}
+
+// Programs built from one source file, one per (kernel, specialization),
+// kept in least-recently-used order and evicted beyond `capacity`.
+class KernelCache {
+public:
+    size_t hits = 0;
+    size_t misses = 0;
+
+    KernelCache(cl_context context, cl_device_id device, const char *source_path, size_t capacity = 16)
+        : context(context), device(device), capacity(capacity) {
+        FILE *kernel_file = fopen(source_path, "r");
+        CHK(kernel_file);
+        fseek(kernel_file, 0, SEEK_END);
+        size_t source_len = ftell(kernel_file);
+        fseek(kernel_file, 0, SEEK_SET);
+        source.resize(source_len);
+        CHK(fread(&source[0], 1, source_len, kernel_file) == source_len);
+        fclose(kernel_file);
+    }
+
+    ~KernelCache() {
+        for (Entry &entry : entries)
+            release(entry);
+    }
+
+    KernelCache(const KernelCache &) = delete;
+    KernelCache &operator=(const KernelCache &) = delete;
+
+    // The returned kernel stays valid until the next call to get().
+    // A variant that fails to build is replaced by the generic kernel.
+    cl_kernel get(const char *name, const Specialization &spec = {}) {
+        std::string options = build_options(spec);
+        std::string key = std::string(name) + ' ' + options;
+        auto it = index.find(key);
+        if (it != index.end()) {
+            ++hits;
+            entries.splice(entries.begin(), entries, it->second);
+            return it->second->kernel;
+        }
+        ++misses;
+        cl_program program = build(options);
+        if (!program) {
+            CHK(!spec.empty());
+            fprintf(stderr, "Variant '%s' of %s failed to build, using the generic kernel\n", options.c_str(), name);
+            program = build("");
+            CHK(program);
+        }
+        cl_kernel kernel = clCreateKernel(program, name, nullptr);
+        CHK(kernel);
+        entries.push_front({key, program, kernel});
+        index[key] = entries.begin();
+        if (entries.size() > capacity) {
+            index.erase(entries.back().key);
+            release(entries.back());
+            entries.pop_back();
+        }
+        return kernel;
+    }
+
+private:
+    struct Entry {
+        std::string key;
+        cl_program program;
+        cl_kernel kernel;
+    };
+
+    cl_context context;
+    cl_device_id device;
+    size_t capacity;
+    std::string source;
+    std::list<Entry> entries;
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+
+    cl_program build(const std::string &options) {
+        const char *src = source.c_str();
+        size_t source_len = source.size();
+        cl_program program = clCreateProgramWithSource(context, 1, &src, &source_len, nullptr);
+        CHK(program);
+        if (clBuildProgram(program, 1, &device, options.c_str(), nullptr, nullptr) != CL_SUCCESS) {
+            size_t log_size;
+            clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
+            char *log = (char *) malloc(log_size);
+
+            clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, log_size, log, NULL);
+            fprintf(stderr, "%s\n", log);
+            free(log);
+            clReleaseProgram(program);
+            return nullptr;
+        }
+        return program;
+    }
+
+    static void release(Entry &entry) {
+        clReleaseKernel(entry.kernel);
+        clReleaseProgram(entry.program);
+    }
+};
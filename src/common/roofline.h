@@ -0,0 +1,388 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <dirent.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <omp.h>
+#include <CL/cl.h>
+#include "chk.h"
+#include "cl_env.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+// Roofline reports: achieved op/s of a kernel against min(peak op/s,
+// arithmetic intensity * memory bandwidth), with both roofs measured on this
+// machine at startup, plus hardware counters collected around the kernel.
+
+constexpr size_t STREAM_SIZE = 1 << 24;
+constexpr size_t CACHE_LINE = 64;
+
+// Operations (a multiply-add counts as two) and bytes of compulsory memory
+// traffic of one kernel run, as given by the caller's model of the kernel.
+struct Work {
+    double ops;
+    double bytes;
+};
+
+struct Roof {
+    const char *name;
+    double peak_ops;   // op/s, 0 when unknown
+    double bandwidth;  // bytes/s
+};
+
+enum Counter { CYCLES, INSTRUCTIONS, LLC_MISSES, FP_OPS, COUNTER_COUNT };
+
+struct CounterValues {
+    double value[COUNTER_COUNT] = {};
+    bool available[COUNTER_COUNT] = {};
+};
+
+inline long perf_event_open(perf_event_attr *attr, pid_t pid, int cpu, int group_fd, unsigned long flags) {
+    return syscall(SYS_perf_event_open, attr, pid, cpu, group_fd, flags);
+}
+
+// Raw events counting retired floating-point operations and the number of
+// operations each one stands for. Intel counts FP_ARITH_INST_RETIRED per
+// vector width (Broadwell and later, FMA counted twice), AMD Zen counts
+// operations directly. Empty on anything else.
+inline std::vector<std::pair<uint64_t, double>> fp_events() {
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(0, &eax, &ebx, &ecx, &edx))
+        return {};
+    char vendor[13] = {};
+    memcpy(vendor, &ebx, 4);
+    memcpy(vendor + 4, &edx, 4);
+    memcpy(vendor + 8, &ecx, 4);
+    if (!strcmp(vendor, "GenuineIntel")) {
+        std::vector<std::pair<uint64_t, double>> events;
+        const double lanes[] = {1, 1, 2, 4, 4, 8, 8, 16};
+        for (int bit = 0; bit < 8; ++bit)
+            events.push_back({0xc7 | (uint64_t(1) << bit) << 8, lanes[bit]});
+        return events;
+    }
+    if (!strcmp(vendor, "AuthenticAMD"))
+        return {{0xff03, 1}};
+#endif
+    return {};
+}
+
+// Every event is opened on each thread of the process and inherited by the
+// threads created later, so OpenMP workers are counted however old the pool
+// is. Counts are scaled up when the kernel multiplexed them with others.
+class PerfCounters {
+public:
+    PerfCounters() {
+        add(CYCLES, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+        add(INSTRUCTIONS, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+        add(LLC_MISSES, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+        for (const auto &[config, weight] : fp_events())
+            add(FP_OPS, PERF_TYPE_RAW, config, weight);
+    }
+
+    ~PerfCounters() {
+        for (Event &event : events)
+            for (int fd : event.fds)
+                close(fd);
+    }
+
+    PerfCounters(const PerfCounters &) = delete;
+    PerfCounters &operator=(const PerfCounters &) = delete;
+
+    void start() {
+        for (Event &event : events) {
+            for (int fd : event.fds) {
+                ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+    }
+
+    CounterValues stop() {
+        for (Event &event : events)
+            for (int fd : event.fds)
+                ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        CounterValues values;
+        for (int c = 0; c < COUNTER_COUNT; ++c)
+            values.available[c] = opened[c] && !failed[c];
+        for (Event &event : events) {
+            for (int fd : event.fds) {
+                uint64_t data[3];  // value, time enabled, time running
+                if (read(fd, data, sizeof(data)) != sizeof(data)) {
+                    values.available[event.counter] = false;
+                    continue;
+                }
+                double scale = data[2] ? double(data[1]) / double(data[2]) : 0.0;
+                values.value[event.counter] += event.weight * double(data[0]) * scale;
+            }
+        }
+        return values;
+    }
+
+private:
+    struct Event {
+        Counter counter;
+        double weight;
+        std::vector<int> fds;
+    };
+
+    std::vector<Event> events;
+    bool opened[COUNTER_COUNT] = {};
+    bool failed[COUNTER_COUNT] = {};
+
+    void add(Counter counter, uint32_t type, uint64_t config, double weight = 1.0) {
+        opened[counter] = true;
+        if (failed[counter])
+            return;
+        perf_event_attr attr = {};
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        Event event = {counter, weight, {}};
+        DIR *tasks = opendir("/proc/self/task");
+        CHK(tasks);
+        while (dirent *entry = readdir(tasks)) {
+            if (entry->d_name[0] == '.')
+                continue;
+            int fd = perf_event_open(&attr, atoi(entry->d_name), -1, -1, PERF_FLAG_FD_CLOEXEC);
+            if (fd < 0) {
+                static bool warned = false;
+                if (!warned) {
+                    fprintf(stderr, "perf_event_open failed: %s, hardware counters are unavailable "
+                                    "(see /proc/sys/kernel/perf_event_paranoid)\n", strerror(errno));
+                    warned = true;
+                }
+                failed[counter] = true;
+                break;
+            }
+            event.fds.push_back(fd);
+        }
+        closedir(tasks);
+        if (failed[counter]) {
+            for (int fd : event.fds)
+                close(fd);
+            return;
+        }
+        events.push_back(std::move(event));
+    }
+};
+
+// Wall time of f(), with the hardware counters collected around it.
+template <typename Func>
+double measure(Func f, CounterValues &values) {
+    PerfCounters counters;
+    double start = omp_get_wtime();
+    counters.start();
+    f();
+    values = counters.stop();
+    return omp_get_wtime() - start;
+}
+
+// Best host bandwidth over all threads, from two kernels whose traffic is
+// counted the way the reported kernels count theirs: the STREAM triad
+// a = b + 3 * c at 32 bytes per element, as storing to a first reads its
+// line, and the read-modify-write update a += 3 * b at 24 bytes, the access
+// pattern of axpy. Arrays are first touched by the threads that use them so
+// every page is local to its NUMA node.
+inline double stream_bandwidth() {
+    double *a = (double *) malloc(sizeof(double) * STREAM_SIZE);
+    double *b = (double *) malloc(sizeof(double) * STREAM_SIZE);
+    double *c = (double *) malloc(sizeof(double) * STREAM_SIZE);
+    CHK(a && b && c);
+    #pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < STREAM_SIZE; ++i) {
+        a[i] = 1.0;
+        b[i] = 2.0;
+        c[i] = 0.5;
+    }
+    double best = 0.0;
+    for (int rep = 0; rep < 30; ++rep) {
+        double start = omp_get_wtime();
+        #pragma omp parallel for schedule(static)
+        for (size_t i = 0; i < STREAM_SIZE; ++i)
+            a[i] = b[i] + 3.0 * c[i];
+        double seconds = omp_get_wtime() - start;
+        best = std::max(best, 4 * sizeof(double) * STREAM_SIZE / seconds);
+
+        start = omp_get_wtime();
+        #pragma omp parallel for schedule(static)
+        for (size_t i = 0; i < STREAM_SIZE; ++i)
+            a[i] += 3.0 * b[i];
+        seconds = omp_get_wtime() - start;
+        best = std::max(best, 3 * sizeof(double) * STREAM_SIZE / seconds);
+    }
+    CHK(a[STREAM_SIZE / 2] == 9.5);
+    free(a);
+    free(b);
+    free(c);
+    return best;
+}
+
+// Best multiply-add throughput over all threads on independent accumulator
+// chains, in the same element type and with the same compiler flags as the
+// kernels it is compared with. Integers accumulate unsigned so they may wrap.
+template <typename T>
+double peak_ops() {
+    using Acc = typename std::conditional_t<std::is_integral_v<T>, std::make_unsigned<T>, std::common_type<T>>::type;
+    constexpr int LANES = 32;
+    constexpr long ITERATIONS = 1 << 20;
+    // Opaque to the compiler, so the chains cannot be folded
+    static volatile Acc one = Acc(1);
+    double best = 0.0;
+    for (int rep = 0; rep < 3; ++rep) {
+        int threads = 1;
+        Acc total = 0;
+        double start = omp_get_wtime();
+        #pragma omp parallel reduction(+:total)
+        {
+            Acc mul = one, add = one;
+            Acc acc[LANES];
+            for (int l = 0; l < LANES; ++l)
+                acc[l] = Acc(l);
+            for (long it = 0; it < ITERATIONS; ++it) {
+                #pragma omp simd
+                for (int l = 0; l < LANES; ++l)
+                    acc[l] = acc[l] * mul + add;
+            }
+            for (int l = 0; l < LANES; ++l)
+                total += acc[l];
+            if (omp_get_thread_num() == 0)
+                threads = omp_get_num_threads();
+        }
+        double seconds = omp_get_wtime() - start;
+        // Keeps the chains live
+        CHK(total != Acc(0));
+        best = std::max(best, 2.0 * LANES * ITERATIONS * threads / seconds);
+    }
+    return best;
+}
+
+// Device copy bandwidth from the profiling events of clEnqueueCopyBuffer,
+// which reads and writes every byte once.
+inline double device_bandwidth() {
+    ClEnv &env = cl_env();
+    size_t bytes = STREAM_SIZE * sizeof(double);
+    cl_mem src = clCreateBuffer(env.context, CL_MEM_READ_WRITE, bytes, nullptr, nullptr);
+    CHK(src);
+    cl_mem dst = clCreateBuffer(env.context, CL_MEM_READ_WRITE, bytes, nullptr, nullptr);
+    CHK(dst);
+    double best = 0.0;
+    for (int rep = 0; rep < 5; ++rep) {
+        cl_event event;
+        CHK(!clEnqueueCopyBuffer(env.queue, src, dst, 0, 0, bytes, 0, nullptr, &event));
+        CHK(!clWaitForEvents(1, &event));
+        double seconds = event_seconds(event);
+        if (seconds > 0)
+            best = std::max(best, 2 * bytes / seconds);
+        CHK(!clReleaseEvent(event));
+    }
+    CHK(!clReleaseMemObject(src));
+    CHK(!clReleaseMemObject(dst));
+    return best;
+}
+
+inline double host_bandwidth() {
+    static double bandwidth = stream_bandwidth();
+    return bandwidth;
+}
+
+template <typename T>
+const Roof &host_roof() {
+    static const Roof roof = {
+        std::is_same_v<T, float> ? "host float" : std::is_same_v<T, double> ? "host double" : "host int",
+        peak_ops<T>(),
+        host_bandwidth(),
+    };
+    return roof;
+}
+
+// Only the memory roof is known for the device, so its kernels are reported
+// by the bandwidth they sustain.
+inline const Roof &device_roof() {
+    static const Roof roof = {"device", 0.0, device_bandwidth()};
+    return roof;
+}
+
+inline void print_roof(const Roof &roof) {
+    printf("Roof '%s': bandwidth %.3f GB/s", roof.name, roof.bandwidth * 1e-9);
+    if (roof.peak_ops > 0)
+        printf(", peak %.3f Gop/s, ridge point %.3f op/B", roof.peak_ops * 1e-9, roof.peak_ops / roof.bandwidth);
+    else
+        printf(", peak n/a");
+    printf("\n");
+}
+
+inline void report_roofline(const char *name, double seconds, Work work, const Roof &roof,
+                            const CounterValues *counters = nullptr) {
+    double ops_rate = work.ops / seconds;
+    double bytes_rate = work.bytes / seconds;
+    double intensity = work.ops / work.bytes;
+    if (roof.peak_ops > 0) {
+        double memory_roof = intensity * roof.bandwidth;
+        bool compute_bound = roof.peak_ops < memory_roof;
+        double attainable = compute_bound ? roof.peak_ops : memory_roof;
+        printf("%s roofline: %.3f Gop/s, %.3f GB/s, intensity %.3f op/B, %s-bound roof %.3f Gop/s ('%s'), %.1f%% of roofline\n",
+               name, ops_rate * 1e-9, bytes_rate * 1e-9, intensity, compute_bound ? "compute" : "memory",
+               attainable * 1e-9, roof.name, 100.0 * ops_rate / attainable);
+    } else {
+        // Without a peak there is no roofline to place the kernel under,
+        // only the bandwidth it sustained
+        printf("%s roofline: %.3f Gop/s, %.3f GB/s, intensity %.3f op/B, peak n/a ('%s'), %.1f%% of %.3f GB/s bandwidth\n",
+               name, ops_rate * 1e-9, bytes_rate * 1e-9, intensity, roof.name, 100.0 * bytes_rate / roof.bandwidth,
+               roof.bandwidth * 1e-9);
+    }
+    if (!counters)
+        return;
+    const double *v = counters->value;
+    const bool *available = counters->available;
+    printf("%s counters:", name);
+    if (available[CYCLES])
+        printf(" cycles %.4g,", v[CYCLES]);
+    else
+        printf(" cycles n/a,");
+    if (available[CYCLES] && available[INSTRUCTIONS] && v[CYCLES] > 0)
+        printf(" IPC %.2f,", v[INSTRUCTIONS] / v[CYCLES]);
+    else
+        printf(" IPC n/a,");
+    // Every LLC miss moves one line from memory: the measured intensity
+    if (available[LLC_MISSES] && v[LLC_MISSES] > 0)
+        printf(" LLC misses %.4g (%.3f op/B measured),", v[LLC_MISSES], work.ops / (v[LLC_MISSES] * CACHE_LINE));
+    else if (available[LLC_MISSES])
+        printf(" LLC misses 0,");
+    else
+        printf(" LLC misses n/a,");
+    if (available[FP_OPS])
+        printf(" FP ops %.4g\n", v[FP_OPS]);
+    else
+        printf(" FP ops n/a\n");
+}
+
+// Times one call of an OpenCL entry point f() that returns its kernel time.
+// The wall time, transfers included, is printed under `label`, but only the
+// kernel time is set against the device roof.
+template <typename Func>
+void report_kernel(const char *label, const char *name, Work work, Func f) {
+    double start = omp_get_wtime();
+    double kernel_time = f();
+    double time = omp_get_wtime() - start;
+    printf("%s execution time: %lf, kernel time: %lf\n", label, time, kernel_time);
+    report_roofline(name, kernel_time, work, device_roof());
+}
@@ -0,0 +1,187 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <type_traits>
+#include <omp.h>
+#include "chk.h"
+
+// Number of elements a single thread recomputes and compares at once.
+// Only one such chunk per thread is resident during verification.
+constexpr size_t VERIFY_CHUNK = 1 << 16;
+
+// An element passes if it is within `max_ulps` units in the last place of
+// the reference, or within `max_rel` relative error of it. Integers are
+// compared by absolute difference against `max_ulps`.
+template <typename T>
+struct Tolerance {
+    int64_t max_ulps;
+    double max_rel;
+};
+
+template <typename T>
+constexpr Tolerance<T> default_tolerance() {
+    if constexpr (std::is_integral_v<T>) {
+        return {0, 0.0};
+    } else if constexpr (std::is_same_v<T, float>) {
+        return {4, 1e-6};
+    } else {
+        return {4, 1e-14};
+    }
+}
+
+template <typename T>
+int64_t ulp_distance(T a, T b) {
+    static_assert(std::is_floating_point_v<T>);
+    if (std::isnan(a) || std::isnan(b))
+        return std::numeric_limits<int64_t>::max();
+    using Bits = std::conditional_t<sizeof(T) == sizeof(int32_t), int32_t, int64_t>;
+    Bits ia, ib;
+    memcpy(&ia, &a, sizeof(T));
+    memcpy(&ib, &b, sizeof(T));
+    // Turn sign-magnitude into a monotonic two's complement ordering
+    if (ia < 0) ia = std::numeric_limits<Bits>::min() - ia;
+    if (ib < 0) ib = std::numeric_limits<Bits>::min() - ib;
+    uint64_t d = ia > ib ? uint64_t(ia) - uint64_t(ib) : uint64_t(ib) - uint64_t(ia);
+    return d > uint64_t(std::numeric_limits<int64_t>::max()) ? std::numeric_limits<int64_t>::max() : int64_t(d);
+}
+
+struct VerifyReport {
+    size_t checked = 0;
+    size_t mismatches = 0;
+    size_t first_mismatch = SIZE_MAX;
+    int64_t max_ulps = 0;
+    double max_rel = 0.0;
+
+    bool ok() const { return mismatches == 0; }
+};
+
+template <typename T>
+bool within_tolerance(T actual, T reference, Tolerance<T> tol, int64_t &ulps, double &rel) {
+    if constexpr (std::is_integral_v<T>) {
+        int64_t d = int64_t(actual) - int64_t(reference);
+        ulps = d < 0 ? -d : d;
+        rel = reference ? double(ulps) / std::abs(double(reference)) : double(ulps);
+        return ulps <= tol.max_ulps;
+    } else {
+        ulps = ulp_distance(actual, reference);
+        double denom = std::max(std::abs(double(reference)), double(std::numeric_limits<T>::min()));
+        rel = std::abs(double(actual) - double(reference)) / denom;
+        return ulps <= tol.max_ulps || rel <= tol.max_rel;
+    }
+}
+
+// Compares actual[0, n) against a reference that `fill(begin, end, ref)`
+// recomputes into ref[0, end - begin). No full reference copy is kept.
+template <typename T, typename Fill>
+VerifyReport verify_stream(const T *actual, size_t n, Fill fill,
+                           Tolerance<T> tol = default_tolerance<T>(), size_t chunk = VERIFY_CHUNK) {
+    size_t chunks = (n + chunk - 1) / chunk;
+    size_t mismatches = 0;
+    size_t first_mismatch = SIZE_MAX;
+    int64_t max_ulps = 0;
+    double max_rel = 0.0;
+    #pragma omp parallel reduction(+:mismatches) reduction(min:first_mismatch) reduction(max:max_ulps, max_rel)
+    {
+        T *ref = (T *) malloc(sizeof(T) * chunk);
+        CHK(ref);
+        #pragma omp for schedule(dynamic)
+        for (size_t c = 0; c < chunks; ++c) {
+            size_t begin = c * chunk;
+            size_t end = std::min(begin + chunk, n);
+            fill(begin, end, ref);
+            for (size_t i = begin; i < end; ++i) {
+                int64_t ulps;
+                double rel;
+                if (!within_tolerance(actual[i], ref[i - begin], tol, ulps, rel)) {
+                    ++mismatches;
+                    first_mismatch = std::min(first_mismatch, i);
+                }
+                max_ulps = std::max(max_ulps, ulps);
+                max_rel = std::max(max_rel, rel);
+            }
+        }
+        free(ref);
+    }
+    VerifyReport report;
+    report.checked = n;
+    report.mismatches = mismatches;
+    report.first_mismatch = first_mismatch;
+    report.max_ulps = max_ulps;
+    report.max_rel = max_rel;
+    return report;
+}
+
+inline void print_report(const char *name, const VerifyReport &report) {
+    if (report.ok()) {
+        printf("'%s' verified: %zu elements, max ulps %lld, max rel error %g\n",
+               name, report.checked, (long long) report.max_ulps, report.max_rel);
+    } else {
+        printf("ERROR: '%s' wrong result!!! %zu/%zu mismatches, first at %zu, max ulps %lld, max rel error %g\n",
+               name, report.mismatches, report.checked, report.first_mismatch,
+               (long long) report.max_ulps, report.max_rel);
+    }
+}
+
+// Freivalds' randomized check of C == scale * A * B in O(n^2) per trial.
+// A is rows x inner, B is inner x cols, C is rows x cols, all row-major with
+// leading dimensions lda/ldb/ldc. A wrong product survives a trial with
+// probability at most 1/2, so `trials` rounds bound false acceptance by 2^-trials.
+template <typename T>
+bool freivalds_check(const T *a, const T *b, const T *c, size_t rows, size_t inner, size_t cols,
+                     size_t lda, size_t ldb, size_t ldc, int trials = 16, T scale = 1,
+                     Tolerance<T> tol = default_tolerance<T>(), unsigned seed = 42) {
+    using Acc = std::conditional_t<std::is_integral_v<T>, int64_t, double>;
+    std::mt19937 gen(seed);
+    Acc *r = (Acc *) malloc(sizeof(Acc) * cols);
+    Acc *br = (Acc *) malloc(sizeof(Acc) * inner);
+    double *br_abs = (double *) malloc(sizeof(double) * inner);
+    CHK(r && br && br_abs);
+    bool ok = true;
+    for (int t = 0; t < trials && ok; ++t) {
+        for (size_t j = 0; j < cols; ++j)
+            r[j] = Acc(gen() & 1);
+        #pragma omp parallel for
+        for (size_t k = 0; k < inner; ++k) {
+            Acc s = 0;
+            double s_abs = 0.0;
+            for (size_t j = 0; j < cols; ++j) {
+                s += Acc(b[k * ldb + j]) * r[j];
+                s_abs += std::abs(double(b[k * ldb + j])) * double(r[j]);
+            }
+            br[k] = s;
+            br_abs[k] = s_abs;
+        }
+        size_t bad = 0;
+        #pragma omp parallel for reduction(+:bad)
+        for (size_t i = 0; i < rows; ++i) {
+            Acc abr = 0, cr = 0;
+            double bound = 0.0;
+            for (size_t k = 0; k < inner; ++k) {
+                abr += Acc(a[i * lda + k]) * br[k];
+                bound += std::abs(double(a[i * lda + k])) * br_abs[k];
+            }
+            for (size_t j = 0; j < cols; ++j)
+                cr += Acc(c[i * ldc + j]) * r[j];
+            abr *= Acc(scale);
+            if constexpr (std::is_integral_v<T>) {
+                bad += cr != abr;
+            } else {
+                // Rounding in C grows with the length and magnitude of each dot product
+                bound *= std::abs(double(scale)) * (tol.max_rel + double(inner) * std::numeric_limits<T>::epsilon());
+                bad += std::abs(double(cr - abr)) > bound;
+            }
+        }
+        ok = bad == 0;
+    }
+    free(r);
+    free(br);
+    free(br_abs);
+    return ok;
+}
@@ -1,13 +1,31 @@
+// Specialized variants are built with any of N, INCX, INCY defined to a
+// constant (e.g. -DINCX=3 -DINCY=2); the runtime arguments are used otherwise.
+// EXACT_RANGE drops the bounds check when the host launches exactly N items.
+#ifndef N
+#define N n
+#endif
+#ifndef INCX
+#define INCX incx
+#endif
+#ifndef INCY
+#define INCY incy
+#endif
+#ifdef EXACT_RANGE
+#define IN_RANGE(i) 1
+#else
+#define IN_RANGE(i) ((i) < N)
+#endif
+
 __kernel void saxpy_gpu(int n, float a, __global float *x, int incx, __global float *y, int incy) {
     size_t i = get_global_id(0);
-    if (i < n) {
-        y[i * incy] += a * x[i * incx];
+    if (IN_RANGE(i)) {
+        y[i * INCY] += a * x[i * INCX];
     }
 }
 
 __kernel void daxpy_gpu(int n, double a, __global double *x, int incx, __global double *y, int incy) {
     size_t i = get_global_id(0);
-    if (i < n) {
-        y[i * incy] += a * x[i * incx];
+    if (IN_RANGE(i)) {
+        y[i * INCY] += a * x[i * INCX];
     }
 }
@@ -1,13 +1,17 @@
+#include <algorithm>
 #include <cstdio>
 #include <cmath>
+#include <cstring>
+#include <memory>
+#include <vector>
 #include <omp.h>
 #include <CL/cl.h>
-
-#define CHK(expr)                                               \
-    if (!(expr)) {                                              \
-        fprintf(stderr, "Failed at %s:%d\n", __FILE__, __LINE__); \
-        abort();                                                \
-    }
+#include "chk.h"
+#include "cl_env.h"
+#include "cl_shards.h"
+#include "kernel_cache.h"
+#include "roofline.h"
+#include "verify.h"
 
 void saxpy(size_t n, float a, float *x, int incx, float *y, int incy) {
     for (int i = 0; i < n; ++i) {
@@ -35,202 +39,195 @@ void daxpy_omp(size_t n, double a, double *x, int incx, double *y, int incy) {
     }
 }
 
-long closest_bigger_degree_of_two(long x) {
-    long d2 = 1;
-    while (true) {
-        if (d2 >= x) return d2;
-        d2 *= 2;
-    }
-    return 0;
+size_t round_up(size_t x, size_t to) {
+    return (x + to - 1) / to * to;
 }
 
-void saxpy_gpu(size_t n, float a, float *x, int incx, float *y, int incy) {
-    cl_int ret = CL_SUCCESS;
-    cl_uint platform_count = 0;
-    size_t global_work_size = closest_bigger_degree_of_two(n * incy);
-    CHK(!clGetPlatformIDs(0, nullptr, &platform_count));
-
-    cl_platform_id *platforms = (cl_platform_id *) malloc(sizeof(cl_platform_id) * platform_count);
-    CHK(!clGetPlatformIDs(platform_count, platforms, nullptr));
-    for (cl_uint i = 0; i < platform_count; ++i) {
-        char platformName[128];
-        CHK(!clGetPlatformInfo(platforms[i], CL_PLATFORM_NAME, 128, platformName, nullptr));
-    }
-    if (platform_count == 0) {
-        fprintf(stderr, "No platform found!\n");
-        abort();
-    }
+KernelCache &axpy_kernels() {
+    static KernelCache cache(cl_env().context, cl_env().device, "lab2.cl");
+    return cache;
+}
 
-    cl_context_properties properties[3] = {
-        CL_CONTEXT_PLATFORM, (cl_context_properties) platforms[0], 0
-    };
-    cl_uint device_count = 0;
-    CHK(!clGetDeviceIDs(platforms[0], CL_DEVICE_TYPE_GPU, 0, nullptr, &device_count));
-    CHK(device_count);
-    cl_device_id *devices = (cl_device_id *) malloc(sizeof(cl_device_id) * device_count);
-    CHK(devices);
-    CHK(!clGetDeviceIDs(platforms[0], CL_DEVICE_TYPE_GPU, device_count, devices, nullptr));
-    cl_context context = clCreateContext(nullptr, 1, &devices[0], nullptr, nullptr, &ret);
-    CHK(context);
+// Runs the `kernel_name` variant selected by `spec` and returns the device
+// time of the kernel alone. Every variant launches the same n work items
+// rounded up to whole work-groups, so only the baked-in constants differ.
+template <typename T>
+double axpy_gpu(const char *kernel_name, const Specialization &spec, size_t n, T a, T *x, int incx, T *y, int incy) {
+    ClEnv &env = cl_env();
+    size_t workgroup_size = 256;
+    size_t global_work_size = round_up(n, workgroup_size);
+    if (spec.count("EXACT_RANGE"))
+        CHK(n % workgroup_size == 0);
 
-    cl_mem xs_buff = clCreateBuffer(context, CL_MEM_WRITE_ONLY, sizeof(float) * n * incx, x, nullptr);
+    cl_mem xs_buff = clCreateBuffer(env.context, CL_MEM_READ_ONLY, sizeof(T) * n * incx, nullptr, nullptr);
     CHK(xs_buff);
 
-    cl_mem ys_buff = clCreateBuffer(context, CL_MEM_READ_ONLY, sizeof(float) * n * incy, y, nullptr);
+    cl_mem ys_buff = clCreateBuffer(env.context, CL_MEM_READ_WRITE, sizeof(T) * n * incy, nullptr, nullptr);
     CHK(ys_buff);
 
-    cl_command_queue queue = clCreateCommandQueue(context, devices[0], 0, nullptr);
-
     cl_event buff_events[2];
-    CHK(!clEnqueueWriteBuffer(queue, xs_buff, CL_FALSE, 0, sizeof(float) * n * incx, x, 0, nullptr, &buff_events[0]));
-    CHK(!clEnqueueWriteBuffer(queue, ys_buff, CL_FALSE, 0, sizeof(float) * n * incy, y, 0, nullptr, &buff_events[1]));
-
-    FILE *kernel_file = fopen("lab2.cl", "r");
-    fseek(kernel_file, 0, SEEK_END);
-    size_t source_len = ftell(kernel_file);
-    fseek(kernel_file, 0, SEEK_SET);
-    char *source = (char *) calloc(1, source_len + 1);
-    fread(source, 1, source_len, kernel_file);
-
-    cl_program program = clCreateProgramWithSource(context, 1, (const char**)&source, &source_len, nullptr);
-    if (clBuildProgram(program, 1, &devices[0], nullptr, nullptr, nullptr) == CL_BUILD_PROGRAM_FAILURE) {
-        size_t log_size;
-        clGetProgramBuildInfo(program, devices[0], CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
-        char *log = (char *) malloc(log_size);
+    CHK(!clEnqueueWriteBuffer(env.queue, xs_buff, CL_FALSE, 0, sizeof(T) * n * incx, x, 0, nullptr, &buff_events[0]));
+    CHK(!clEnqueueWriteBuffer(env.queue, ys_buff, CL_FALSE, 0, sizeof(T) * n * incy, y, 0, nullptr, &buff_events[1]));
 
-        clGetProgramBuildInfo(program, devices[0], CL_PROGRAM_BUILD_LOG, log_size, log, NULL);
-        fprintf(stderr, "%s\n", log);
-        abort();
-    }
-
-    cl_kernel kernel = clCreateKernel(program, "saxpy_gpu", nullptr);
-
-    size_t workgroup_size = 256;
+    cl_kernel kernel = axpy_kernels().get(kernel_name, spec);
 
-    CHK(!clSetKernelArg(kernel, 0, sizeof(int), &n));
-    CHK(!clSetKernelArg(kernel, 1, sizeof(float), &a));
+    int n_arg = n;
+    CHK(!clSetKernelArg(kernel, 0, sizeof(int), &n_arg));
+    CHK(!clSetKernelArg(kernel, 1, sizeof(T), &a));
     CHK(!clSetKernelArg(kernel, 2, sizeof(cl_mem), &xs_buff));
     CHK(!clSetKernelArg(kernel, 3, sizeof(int), &incx));
     CHK(!clSetKernelArg(kernel, 4, sizeof(cl_mem), &ys_buff));
     CHK(!clSetKernelArg(kernel, 5, sizeof(int), &incy));
 
-    CHK(!clEnqueueNDRangeKernel(queue, kernel, 1, nullptr, &global_work_size, &workgroup_size, 2, buff_events, nullptr));
-    CHK(!clFinish(queue));
+    cl_event kernel_event;
+    CHK(!clEnqueueNDRangeKernel(env.queue, kernel, 1, nullptr, &global_work_size, &workgroup_size, 2, buff_events, &kernel_event));
+    CHK(!clFinish(env.queue));
+    double kernel_time = event_seconds(kernel_event);
 
-    CHK(!clEnqueueReadBuffer(queue, ys_buff, CL_TRUE, 0, sizeof(float) * n * incy, y, 0, nullptr, nullptr));
+    CHK(!clEnqueueReadBuffer(env.queue, ys_buff, CL_TRUE, 0, sizeof(T) * n * incy, y, 0, nullptr, nullptr));
 
-    free(source);
+    CHK(!clReleaseEvent(buff_events[0]));
+    CHK(!clReleaseEvent(buff_events[1]));
+    CHK(!clReleaseEvent(kernel_event));
     CHK(!clReleaseMemObject(xs_buff));
     CHK(!clReleaseMemObject(ys_buff));
-    CHK(!clReleaseProgram(program));
-    CHK(!clReleaseKernel(kernel));
-    CHK(!clReleaseCommandQueue(queue));
-    CHK(!clReleaseContext(context));
+    return kernel_time;
 }
 
-void daxpy_gpu(size_t n, double a, double *x, int incx, double *y, int incy) {
-    cl_int ret = CL_SUCCESS;
-    cl_uint platform_count = 0;
-    size_t global_work_size = closest_bigger_degree_of_two(n * incy);
-    CHK(!clGetPlatformIDs(0, nullptr, &platform_count));
-
-    cl_platform_id *platforms = (cl_platform_id *) malloc(sizeof(cl_platform_id) * platform_count);
-    CHK(!clGetPlatformIDs(platform_count, platforms, nullptr));
-    for (cl_uint i = 0; i < platform_count; ++i) {
-        char platformName[128];
-        CHK(!clGetPlatformInfo(platforms[i], CL_PLATFORM_NAME, 128, platformName, nullptr));
-    }
-    if (platform_count == 0) {
-        fprintf(stderr, "No platform found!\n");
-        abort();
-    }
-
-    cl_context_properties properties[3] = {
-        CL_CONTEXT_PLATFORM, (cl_context_properties) platforms[0], 0
-    };
-    cl_uint device_count = 0;
-    CHK(!clGetDeviceIDs(platforms[0], CL_DEVICE_TYPE_GPU, 0, nullptr, &device_count));
-    CHK(device_count);
-    cl_device_id *devices = (cl_device_id *) malloc(sizeof(cl_device_id) * device_count);
-    CHK(devices);
-    CHK(!clGetDeviceIDs(platforms[0], CL_DEVICE_TYPE_GPU, device_count, devices, nullptr));
-    cl_context context = clCreateContext(nullptr, 1, &devices[0], nullptr, nullptr, &ret);
-    CHK(context);
+double saxpy_gpu(size_t n, float a, float *x, int incx, float *y, int incy) {
+    return axpy_gpu("saxpy_gpu", {}, n, a, x, incx, y, incy);
+}
 
-    cl_mem xs_buff = clCreateBuffer(context, CL_MEM_WRITE_ONLY, sizeof(double) * n * incx, x, nullptr);
-    CHK(xs_buff);
+double daxpy_gpu(size_t n, double a, double *x, int incx, double *y, int incy) {
+    return axpy_gpu("daxpy_gpu", {}, n, a, x, incx, y, incy);
+}
 
-    cl_mem ys_buff = clCreateBuffer(context, CL_MEM_READ_ONLY, sizeof(double) * n * incy, y, nullptr);
-    CHK(ys_buff);
+// Host wall time of the whole call, set against the host roof.
+template <typename Func, typename... Args>
+void bench(const char *name, const Roof &roof, Work work, Func f, Args... args) {
+    printf("Started %s\n", name);
+    CounterValues counters;
+    double time = measure([&] { f(args...); }, counters);
+    printf("%s execution time: %lf\n", name, time);
+    report_roofline(name, time, work, roof, &counters);
+}
 
-    cl_command_queue queue = clCreateCommandQueue(context, devices[0], 0, nullptr);
+template <typename Func, typename... Args>
+void bench_kernel(const char *name, Work work, Func f, Args... args) {
+    printf("Started %s\n", name);
+    report_kernel(name, name, work, [&] { return f(args...); });
+}
 
-    cl_event buff_events[2];
-    CHK(!clEnqueueWriteBuffer(queue, xs_buff, CL_FALSE, 0, sizeof(double) * n * incx, x, 0, nullptr, &buff_events[0]));
-    CHK(!clEnqueueWriteBuffer(queue, ys_buff, CL_FALSE, 0, sizeof(double) * n * incy, y, 0, nullptr, &buff_events[1]));
+// Two flops per element. x is read and y is read and written; strides
+// shorter than a cache line still move every line of the arrays.
+template <typename T>
+Work axpy_work(size_t n, int incx, int incy) {
+    double x_bytes = std::min(sizeof(T) * incx, CACHE_LINE);
+    double y_bytes = std::min(sizeof(T) * incy, CACHE_LINE);
+    return {2.0 * n, n * (x_bytes + 2 * y_bytes)};
+}
 
-    FILE *kernel_file = fopen("lab2.cl", "r");
-    fseek(kernel_file, 0, SEEK_END);
-    size_t source_len = ftell(kernel_file);
-    fseek(kernel_file, 0, SEEK_SET);
-    char *source = (char *) calloc(1, source_len + 1);
-    fread(source, 1, source_len, kernel_file);
+template <typename T>
+T init_value(size_t i) {
+    return T(.1) * T(i % 10);
+}
 
-    cl_program program = clCreateProgramWithSource(context, 1, (const char**)&source, &source_len, nullptr);
-    if (clBuildProgram(program, 1, &devices[0], nullptr, nullptr, nullptr) == CL_BUILD_PROGRAM_FAILURE) {
-        size_t log_size;
-        clGetProgramBuildInfo(program, devices[0], CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
-        char *log = (char *) malloc(log_size);
+// Recomputes y = a * x + y for y[begin, end) from the initial values,
+// so no reference copy of y has to be kept around.
+template <typename T>
+bool validate_results(const char *name, T *y, size_t n, T a, int incx, int incy) {
+    VerifyReport report = verify_stream(y, n * incy, [=](size_t begin, size_t end, T *ref) {
+        for (size_t j = begin; j < end; ++j) {
+            T v = init_value<T>(j);
+            if (j % incy == 0)
+                v += a * init_value<T>(j / incy * incx);
+            ref[j - begin] = v;
+        }
+    });
+    print_report(name, report);
+    return report.ok();
+}
 
-        clGetProgramBuildInfo(program, devices[0], CL_PROGRAM_BUILD_LOG, log_size, log, NULL);
-        fprintf(stderr, "%s\n", log);
-        abort();
+// Times the generic kernel against variants with more parameters baked in.
+template <typename T, typename Reset>
+void bench_variants(const char *kernel_name, Reset reset, size_t n, T a, T *&x, int incx, T *&y, int incy) {
+    const std::pair<const char *, Specialization> variants[] = {
+        {"generic", {}},
+        {"strides", {{"INCX", incx}, {"INCY", incy}}},
+        {"full", {{"N", long(n)}, {"INCX", incx}, {"INCY", incy}, {"EXACT_RANGE", 1}}},
+    };
+    double generic_time = 0;
+    for (const auto &[variant, spec] : variants) {
+        if (spec.count("EXACT_RANGE") && n % 256 != 0)
+            continue;
+        reset();
+        double kernel_time = axpy_gpu(kernel_name, spec, n, a, x, incx, y, incy);
+        if (spec.empty())
+            generic_time = kernel_time;
+        printf("%s[%s] kernel time: %lf, speedup: %.2fx\n", kernel_name, variant, kernel_time, generic_time / kernel_time);
+        char name[64];
+        snprintf(name, sizeof(name), "%s[%s]", kernel_name, variant);
+        report_roofline(name, kernel_time, axpy_work<T>(n, incx, incy), device_roof());
+        CHK(validate_results(kernel_name, y, n, a, incx, incy));
     }
+}
 
-    cl_kernel kernel = clCreateKernel(program, "daxpy_gpu", nullptr);
-
+// axpy_gpu with x and y split into one contiguous range per shard, each in
+// buffers on the shard's NUMA node, if known, and run on the shard's own queue.
+// Returns the time from the first launch until every shard has finished.
+template <typename T>
+double axpy_sharded(ClShards &shards, const char *kernel_name, size_t n, T a, T *x, int incx, T *y, int incy) {
     size_t workgroup_size = 256;
+    std::vector<std::pair<size_t, size_t>> ranges = shards.split(n, workgroup_size);
+    std::vector<std::unique_ptr<NodeBuffer>> xs_buffs(shards.size()), ys_buffs(shards.size());
+    for (size_t s = 0; s < shards.size(); ++s) {
+        auto [begin, end] = ranges[s];
+        if (begin == end)
+            continue;
+        size_t xs_size = sizeof(T) * (end - begin) * incx, ys_size = sizeof(T) * (end - begin) * incy;
+        xs_buffs[s] = std::make_unique<NodeBuffer>(shards.context, CL_MEM_READ_ONLY, xs_size, shards.nodes[s]);
+        ys_buffs[s] = std::make_unique<NodeBuffer>(shards.context, CL_MEM_READ_WRITE, ys_size, shards.nodes[s]);
+        CHK(!clEnqueueWriteBuffer(shards.queues[s], xs_buffs[s]->mem, CL_FALSE, 0, xs_size, x + begin * incx, 0, nullptr, nullptr));
+        CHK(!clEnqueueWriteBuffer(shards.queues[s], ys_buffs[s]->mem, CL_FALSE, 0, ys_size, y + begin * incy, 0, nullptr, nullptr));
+    }
+    shards.finish();
 
-    CHK(!clSetKernelArg(kernel, 0, sizeof(int), &n));
-    CHK(!clSetKernelArg(kernel, 1, sizeof(double), &a));
-    CHK(!clSetKernelArg(kernel, 2, sizeof(cl_mem), &xs_buff));
-    CHK(!clSetKernelArg(kernel, 3, sizeof(int), &incx));
-    CHK(!clSetKernelArg(kernel, 4, sizeof(cl_mem), &ys_buff));
-    CHK(!clSetKernelArg(kernel, 5, sizeof(int), &incy));
-
-    CHK(!clEnqueueNDRangeKernel(queue, kernel, 1, nullptr, &global_work_size, &workgroup_size, 2, buff_events, nullptr));
-    CHK(!clFinish(queue));
-
-    CHK(!clEnqueueReadBuffer(queue, ys_buff, CL_TRUE, 0, sizeof(double) * n * incy, y, 0, nullptr, nullptr));
-
-    free(source);
-    CHK(!clReleaseMemObject(xs_buff));
-    CHK(!clReleaseMemObject(ys_buff));
-    CHK(!clReleaseProgram(program));
-    CHK(!clReleaseKernel(kernel));
-    CHK(!clReleaseCommandQueue(queue));
-    CHK(!clReleaseContext(context));
-}
-
-template <typename Func, typename... Args>
-void bench(const char *name, Func f, Args... args) {
-    printf("Started %s\n", name);
     double start = omp_get_wtime();
-    f(args...);
-    double finish = omp_get_wtime();
-    printf("%s execution time: %lf\n", name, finish - start);
+    for (size_t s = 0; s < shards.size(); ++s) {
+        auto [begin, end] = ranges[s];
+        if (begin == end)
+            continue;
+        cl_kernel kernel = shards.kernel(s, kernel_name);
+        int n_arg = end - begin;
+        CHK(!clSetKernelArg(kernel, 0, sizeof(int), &n_arg));
+        CHK(!clSetKernelArg(kernel, 1, sizeof(T), &a));
+        CHK(!clSetKernelArg(kernel, 2, sizeof(cl_mem), &xs_buffs[s]->mem));
+        CHK(!clSetKernelArg(kernel, 3, sizeof(int), &incx));
+        CHK(!clSetKernelArg(kernel, 4, sizeof(cl_mem), &ys_buffs[s]->mem));
+        CHK(!clSetKernelArg(kernel, 5, sizeof(int), &incy));
+        size_t global_work_size = round_up(end - begin, workgroup_size);
+        CHK(!clEnqueueNDRangeKernel(shards.queues[s], kernel, 1, nullptr, &global_work_size, &workgroup_size, 0, nullptr, nullptr));
+        CHK(!clFlush(shards.queues[s]));
+    }
+    shards.finish();
+    double kernel_time = omp_get_wtime() - start;
+
+    for (size_t s = 0; s < shards.size(); ++s) {
+        auto [begin, end] = ranges[s];
+        if (begin == end)
+            continue;
+        CHK(!clEnqueueReadBuffer(shards.queues[s], ys_buffs[s]->mem, CL_TRUE, 0, ys_buffs[s]->bytes, y + begin * incy, 0, nullptr, nullptr));
+    }
+    return kernel_time;
 }
 
-const double eps = 1e-5;
-
-template <typename T>
-bool validate_results(T *actual, T *reference, int n) {
-    bool f = true;
-    #pragma omp parallel for
-    for (int i = 0; i < n; ++i) {
-        f &= !(std::abs(actual[i] - reference[i]) > eps);
-    }
-    return f;
+// axpy_sharded on the whole CPU device and on its sub-devices, each from a fresh y.
+template <typename T, typename Reset>
+void bench_shards(const char *kernel_name, Reset reset, size_t n, T a, T *&x, int incx, T *&y, int incy) {
+    compare_shards(kernel_name, "lab2.cl", axpy_work<T>(n, incx, incy), host_roof<T>(), [&](ClShards &shards) {
+        reset();
+        return axpy_sharded(shards, kernel_name, n, a, x, incx, y, incy);
+    }, [&] { CHK(validate_results(kernel_name, y, n, a, incx, incy)); });
 }
 
 void float_test() {
@@ -247,23 +244,27 @@ void float_test() {
         x = (float *) malloc(n * incx * sizeof(float));
         y = (float *) malloc(n * incy * sizeof(float));
         for (int i = 0; i < n * incx; ++i) {
-            x[i] = .1f * (i % 10);
+            x[i] = init_value<float>(i);
         }
         for (int i = 0; i < n * incy; ++i) {
-            y[i] = .1f * (i % 10);
+            y[i] = init_value<float>(i);
         }
     };
     reset();
-    bench("saxpy", saxpy, n, a, x, incx, y, incy);
-    float *ref_y = (float *) malloc(n * incy * sizeof(float));
-    for (int i = 0; i < n * incy; ++i)
-        ref_y[i] = y[i];
+    bench("saxpy", host_roof<float>(), axpy_work<float>(n, incx, incy), saxpy, n, a, x, incx, y, incy);
+    CHK(validate_results("saxpy", y, n, a, incx, incy));
     reset();
-    bench("saxpy_omp", saxpy_omp, n, a, x, incx, y, incy);
-    CHK(validate_results(y, ref_y, n * incy));
-    reset();
-    bench("saxpy_gpu", saxpy_gpu, n, a, x, incx, y, incy);
-    CHK(validate_results(y, ref_y, n * incy));
+    bench("saxpy_omp", host_roof<float>(), axpy_work<float>(n, incx, incy), saxpy_omp, n, a, x, incx, y, incy);
+    CHK(validate_results("saxpy_omp", y, n, a, incx, incy));
+    if (has_gpu()) {
+        reset();
+        bench_kernel("saxpy_gpu", axpy_work<float>(n, incx, incy), saxpy_gpu, n, a, x, incx, y, incy);
+        CHK(validate_results("saxpy_gpu", y, n, a, incx, incy));
+        bench_variants("saxpy_gpu", reset, n, a, x, incx, y, incy);
+    } else {
+        printf("No GPU OpenCL device, skipping the GPU runs\n");
+    }
+    bench_shards("saxpy_gpu", reset, n, a, x, incx, y, incy);
     free(x);
     free(y);
 }
@@ -282,28 +283,44 @@ void double_test() {
         x = (double *) malloc(n * incx * sizeof(double));
         y = (double *) malloc(n * incy * sizeof(double));
         for (int i = 0; i < n * incx; ++i) {
-            x[i] = .1 * (i % 10);
+            x[i] = init_value<double>(i);
         }
         for (int i = 0; i < n * incy; ++i) {
-            y[i] = .1 * (i % 10);
+            y[i] = init_value<double>(i);
         }
     };
     reset();
-    bench("daxpy", daxpy, n, a, x, incx, y, incy);
-    double *ref_y = (double *) malloc(n * incy * sizeof(double));
-    for (int i = 0; i < n * incy; ++i)
-        ref_y[i] = y[i];
+    bench("daxpy", host_roof<double>(), axpy_work<double>(n, incx, incy), daxpy, n, a, x, incx, y, incy);
+    CHK(validate_results("daxpy", y, n, a, incx, incy));
     reset();
-    bench("daxpy_omp", daxpy_omp, n, a, x, incx, y, incy);
-    CHK(validate_results(y, ref_y, n * incy));
-    reset();
-    bench("daxpy_gpu", daxpy_gpu, n, a, x, incx, y, incy);
-    CHK(validate_results(y, ref_y, n * incy));
+    bench("daxpy_omp", host_roof<double>(), axpy_work<double>(n, incx, incy), daxpy_omp, n, a, x, incx, y, incy);
+    CHK(validate_results("daxpy_omp", y, n, a, incx, incy));
+    if (has_gpu()) {
+        reset();
+        bench_kernel("daxpy_gpu", axpy_work<double>(n, incx, incy), daxpy_gpu, n, a, x, incx, y, incy);
+        CHK(validate_results("daxpy_gpu", y, n, a, incx, incy));
+        bench_variants("daxpy_gpu", reset, n, a, x, incx, y, incy);
+    } else {
+        printf("No GPU OpenCL device, skipping the GPU runs\n");
+    }
+    bench_shards("daxpy_gpu", reset, n, a, x, incx, y, incy);
     free(x);
     free(y);
 }
 
 int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--sub-devices") && i + 1 < argc) {
+            sub_device_units = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: %s [--sub-devices COMPUTE_UNITS]\n", argv[0]);
+            return 1;
+        }
+    }
+    print_roof(host_roof<float>());
+    print_roof(host_roof<double>());
+    if (has_gpu())
+        print_roof(device_roof());
     float_test();
     double_test();
     return 0;
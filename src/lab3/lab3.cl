@@ -1,13 +1,25 @@
+// Specialized variants are built with any of N, M, L defined to a constant
+// (e.g. -DM=640 fixes the inner dimension); the runtime arguments are used otherwise.
+#ifndef N
+#define N n
+#endif
+#ifndef M
+#define M m
+#endif
+#ifndef L
+#define L l
+#endif
+
 __kernel void matrix_multiply_naive(__global int* a, __global int* b, __global int* c, int n, int m, int l) {
     size_t global_id0 = get_global_id(0);
     size_t global_id1 = get_global_id(1);
 
     __private int res = 0;
 
-    for (size_t i = 0; i < m; ++i) {
-        res += a[global_id1 * m + i] * b[i * l + global_id0];
+    for (size_t i = 0; i < M; ++i) {
+        res += a[global_id1 * M + i] * b[i * L + global_id0];
     }
-    c[l * global_id1 + global_id0] = res;
+    c[L * global_id1 + global_id0] = res;
 }
 
 #define BLOCK_SIZE 16
@@ -22,15 +34,15 @@ __kernel void matrix_multiply_optimized(__global int* a, __global int* b, __glob
     __local int b_coord[BLOCK_SIZE][BLOCK_SIZE];
     __private int res = 0;
 
-    for (size_t i = 0; i < m / BLOCK_SIZE; ++i) {
-        a_coord[local_id1][local_id0] = a[global_id1 * m + i * BLOCK_SIZE + local_id0];
-        b_coord[local_id1][local_id0] = b[(i * BLOCK_SIZE + local_id1) * l + global_id0];
+    for (size_t i = 0; i < M / BLOCK_SIZE; ++i) {
+        a_coord[local_id1][local_id0] = a[global_id1 * M + i * BLOCK_SIZE + local_id0];
+        b_coord[local_id1][local_id0] = b[(i * BLOCK_SIZE + local_id1) * L + global_id0];
         barrier(CLK_LOCAL_MEM_FENCE);
         for (size_t j = 0; j < BLOCK_SIZE; ++j)
             res += a_coord[local_id1][j] * b_coord[j][local_id0];
         barrier(CLK_LOCAL_MEM_FENCE);
     }
-    c[l * global_id1 + global_id0] = res;
+    c[L * global_id1 + global_id0] = res;
 }
 
 __kernel void matrix_multiply_images(__read_only image2d_t a, __read_only image2d_t b, __write_only image2d_t c, int n, int m, int l) {
@@ -43,17 +55,106 @@ __kernel void matrix_multiply_images(__read_only image2d_t a, __read_only image2
     __local int sub_arr_b[BLOCK_SIZE][BLOCK_SIZE];
     __private int res = 0;
 
-    for (size_t i = 0; i < m / BLOCK_SIZE; ++i) {
-        int2 a_coord = (int2) (global_id0, i * BLOCK_SIZE + local_id1);
-        int2 b_coord = (int2) (i * BLOCK_SIZE + local_id0, global_id1);
+    for (size_t i = 0; i < M / BLOCK_SIZE; ++i) {
+        int2 a_coord = (int2) (i * BLOCK_SIZE + local_id0, global_id1);
+        int2 b_coord = (int2) (global_id0, i * BLOCK_SIZE + local_id1);
 
         sub_arr_a[local_id1][local_id0] = read_imagei(a, a_coord).x;
         sub_arr_b[local_id1][local_id0] = read_imagei(b, b_coord).x;
         barrier(CLK_LOCAL_MEM_FENCE);
         for (size_t j = 0; j < BLOCK_SIZE; ++j)
-            res += sub_arr_a[local_id1][j] * sub_arr_b[j][local_id1];
+            res += sub_arr_a[local_id1][j] * sub_arr_b[j][local_id0];
         barrier(CLK_LOCAL_MEM_FENCE);
     }
     int2 c_coord = (int2) (global_id0, global_id1);
     write_imagei(c, c_coord, (int4)(res, 0, 0, 1));
 }
+
+// BLAS-style C = alpha * op(A) * op(B) + beta * C on row-major storage with
+// leading dimensions; op(A) is m x k, op(B) is k x n. Building with TRANS_A or
+// TRANS_B selects a variant that reads the transposed operand in place: its
+// tile load swaps the local indices so consecutive work-items still read
+// consecutive addresses. Sizes need not be multiples of BLOCK_SIZE.
+//
+// The epilogue runs on the accumulator before the single store. Each stage
+// is compiled in only when its macro is defined, in this order: EPI_ALPHA,
+// EPI_BETA, EPI_ROW_BIAS, EPI_COL_BIAS, EPI_RELU, EPI_CLAMP, EPI_REQUANT.
+// With EPI_REQUANT the result goes to the int8 matrix q (same ldc) instead of c.
+__kernel void xgemm(int m, int n, int k, int alpha, __global const int* a, int lda,
+                    __global const int* b, int ldb, int beta, __global int* c, int ldc,
+                    __global const int* row_bias, __global const int* col_bias, int clamp_min, int clamp_max,
+                    int quant_multiplier, int quant_shift, int quant_zero_point, __global char* q) {
+    int col = get_global_id(0);
+    int row = get_global_id(1);
+    int local_id0 = get_local_id(0);
+    int local_id1 = get_local_id(1);
+    int row0 = get_group_id(1) * BLOCK_SIZE;
+    int col0 = get_group_id(0) * BLOCK_SIZE;
+
+    __local int a_tile[BLOCK_SIZE][BLOCK_SIZE];
+    __local int b_tile[BLOCK_SIZE][BLOCK_SIZE];
+    __private int res = 0;
+
+    for (int t = 0; t < k; t += BLOCK_SIZE) {
+#ifdef TRANS_A
+        a_tile[local_id0][local_id1] = (row0 + local_id0 < m && t + local_id1 < k) ? a[(t + local_id1) * lda + row0 + local_id0] : 0;
+#else
+        a_tile[local_id1][local_id0] = (row < m && t + local_id0 < k) ? a[row * lda + t + local_id0] : 0;
+#endif
+#ifdef TRANS_B
+        b_tile[local_id0][local_id1] = (t + local_id0 < k && col0 + local_id1 < n) ? b[(col0 + local_id1) * ldb + t + local_id0] : 0;
+#else
+        b_tile[local_id1][local_id0] = (t + local_id1 < k && col < n) ? b[(t + local_id1) * ldb + col] : 0;
+#endif
+        barrier(CLK_LOCAL_MEM_FENCE);
+        for (int j = 0; j < BLOCK_SIZE; ++j)
+            res += a_tile[local_id1][j] * b_tile[j][local_id0];
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    if (row < m && col < n) {
+#ifdef EPI_ALPHA
+        res *= alpha;
+#endif
+#ifdef EPI_BETA
+        res += beta * c[row * ldc + col];
+#endif
+#ifdef EPI_ROW_BIAS
+        res += row_bias[row];
+#endif
+#ifdef EPI_COL_BIAS
+        res += col_bias[col];
+#endif
+#ifdef EPI_RELU
+        res = max(res, 0);
+#endif
+#ifdef EPI_CLAMP
+        res = clamp(res, clamp_min, clamp_max);
+#endif
+#ifdef EPI_REQUANT
+        long scaled = ((long) res * quant_multiplier + ((1L << quant_shift) >> 1)) >> quant_shift;
+        q[row * ldc + col] = (char) clamp(scaled + quant_zero_point, -128L, 127L);
+#else
+        c[row * ldc + col] = res;
+#endif
+    }
+}
+
+// C[i] = A[i] * B[i] for get_global_size(2) equally shaped row-major
+// problems packed back to back; each A is rows x inner, each B inner x cols.
+__kernel void matrix_multiply_batched(__global int* a, __global int* b, __global int* c, int rows, int inner, int cols) {
+    size_t col = get_global_id(0);
+    size_t row = get_global_id(1);
+    size_t batch = get_global_id(2);
+    if (row >= rows || col >= cols)
+        return;
+
+    a += batch * rows * inner;
+    b += batch * inner * cols;
+    c += batch * rows * cols;
+
+    __private int res = 0;
+    for (size_t k = 0; k < inner; ++k) {
+        res += a[row * inner + k] * b[k * cols + col];
+    }
+    c[row * cols + col] = res;
+}
@@ -1,12 +1,17 @@
+#include <algorithm>
+#include <cstdint>
 #include <cstdio>
+#include <cstring>
+#include <memory>
+#include <vector>
 #include <omp.h>
 #include <CL/cl.h>
-
-#define CHK(expr)                                               \
-    if (!(expr)) {                                              \
-        fprintf(stderr, "Failed at %s:%d\n", __FILE__, __LINE__); \
-        abort();                                                \
-    }
+#include "chk.h"
+#include "cl_env.h"
+#include "cl_shards.h"
+#include "kernel_cache.h"
+#include "roofline.h"
+#include "verify.h"
 
 constexpr int BLOCK_SIZE = 16;
 
@@ -16,240 +21,456 @@ struct Matrix {
 };
 
 
+// Host wall time of the whole call, set against `roof`.
 template <typename Func, typename... Args>
-void bench(const char *name, int times, Func f, Args... args) {
+void bench(const char *name, int times, const Roof &roof, Work work, Func f, Args... args) {
     for (int i = 0; i < times; ++i) {
         printf("Started %s:%d\n", name, i + 1);
-        double start = omp_get_wtime();
-        f(args...);
-        double finish = omp_get_wtime();
-        printf("%s:%d execution time: %lf\n", name, i + 1, finish - start);
+        CounterValues counters;
+        double time = measure([&] { f(args...); }, counters);
+        printf("%s:%d execution time: %lf\n", name, i + 1, time);
+        report_roofline(name, time, work, roof, &counters);
     }
 }
 
-void matrix_multiply_seq(const Matrix &a, const Matrix &b, Matrix &res) {
-    for (size_t i = 0; i < a.height; ++i) {
-        for (size_t j = 0; j < b.width; ++j) {
-            for (size_t k = 0; k < a.width; ++k) {
-                res.data[i * res.width + j] += a.data[i * a.width + k] * b.data[k * b.width + j];
+template <typename Func, typename... Args>
+void bench_kernel(const char *name, int times, Work work, Func f, Args... args) {
+    for (int i = 0; i < times; ++i) {
+        printf("Started %s:%d\n", name, i + 1);
+        char label[128];
+        snprintf(label, sizeof(label), "%s:%d", name, i + 1);
+        report_kernel(label, name, work, [&] { return f(args...); });
+    }
+}
+
+// 2 * m * n * k operations over the compulsory traffic of reading A and B
+// and writing C once each.
+inline Work gemm_work(int m, int n, int k) {
+    return {2.0 * m * n * k, sizeof(int) * (double(m) * k + double(k) * n + double(m) * n)};
+}
+
+enum Layout { ROW_MAJOR, COL_MAJOR };
+enum Transpose { NO_TRANS, TRANS };
+
+constexpr int TILE = 64;
+
+// Element (row, col) of op(X) for a row-major X with leading dimension ld.
+inline int op_at(Transpose trans, const int *x, int ld, int row, int col) {
+    return trans == TRANS ? x[col * ld + row] : x[row * ld + col];
+}
+
+// Post-processing fused into the store of C. After alpha * op(A) * op(B) +
+// beta * C the stages run in this order: row bias, column bias, ReLU, clamp,
+// requantization. Disabled stages are compiled out of the OpenCL kernel and
+// cost one well-predicted branch per element on the CPU.
+struct Epilogue {
+    const int *row_bias = nullptr;  // one value per row of C
+    const int *col_bias = nullptr;  // one value per column of C
+    bool relu = false;
+    bool clamp = false;
+    int clamp_min = 0, clamp_max = 0;
+    // When set, the result is stored as int8 into q, which shares the layout
+    // and ldc of C, and C itself is left unchanged:
+    // q = saturate((v * quant_multiplier) >> quant_shift, rounded, + quant_zero_point)
+    int8_t *q = nullptr;
+    int quant_multiplier = 1, quant_shift = 0, quant_zero_point = 0;
+};
+
+// The same problem seen through C^T, for column-major inputs.
+inline Epilogue transposed(const Epilogue &epi) {
+    Epilogue res = epi;
+    std::swap(res.row_bias, res.col_bias);
+    return res;
+}
+
+inline int8_t requantize(int v, const Epilogue &epi) {
+    int64_t scaled = (int64_t(v) * epi.quant_multiplier + ((int64_t(1) << epi.quant_shift) >> 1)) >> epi.quant_shift;
+    return int8_t(std::clamp<int64_t>(scaled + epi.quant_zero_point, INT8_MIN, INT8_MAX));
+}
+
+// Bias and activation stages for element (i, j) of C.
+inline int epilogue_value(int v, int i, int j, const Epilogue &epi) {
+    if (epi.row_bias)
+        v += epi.row_bias[i];
+    if (epi.col_bias)
+        v += epi.col_bias[j];
+    if (epi.relu)
+        v = std::max(v, 0);
+    if (epi.clamp)
+        v = std::clamp(v, epi.clamp_min, epi.clamp_max);
+    return v;
+}
+
+// BLAS-style C = alpha * op(A) * op(B) + beta * C, where op(A) is m x k,
+// op(B) is k x n and C is m x n. Column-major problems are solved as the
+// row-major C^T = op(B)^T * op(A)^T, so nothing is ever transposed in memory.
+// As in BLAS, C is not read when beta is zero.
+void xgemm_seq(Layout layout, Transpose trans_a, Transpose trans_b, int m, int n, int k,
+               int alpha, const int *a, int lda, const int *b, int ldb, int beta, int *c, int ldc,
+               const Epilogue &epi = {}) {
+    if (layout == COL_MAJOR) {
+        xgemm_seq(ROW_MAJOR, trans_b, trans_a, n, m, k, alpha, b, ldb, a, lda, beta, c, ldc, transposed(epi));
+        return;
+    }
+    for (int i = 0; i < m; ++i) {
+        for (int j = 0; j < n; ++j) {
+            int res = 0;
+            for (int p = 0; p < k; ++p) {
+                res += op_at(trans_a, a, lda, i, p) * op_at(trans_b, b, ldb, p, j);
             }
+            res = epilogue_value(alpha * res + (beta ? beta * c[i * ldc + j] : 0), i, j, epi);
+            if (epi.q)
+                epi.q[i * ldc + j] = requantize(res, epi);
+            else
+                c[i * ldc + j] = res;
         }
     }
 }
 
-void matrix_multiply_omp(const Matrix &a, const Matrix &b, Matrix &res) {
-    #pragma omp parallel for
-    for (size_t i = 0; i < a.height; ++i) {
-        for (size_t j = 0; j < b.width; ++j) {
-            for (size_t k = 0; k < a.width; ++k) {
-                res.data[i * res.width + j] += a.data[i * a.width + k] * b.data[k * b.width + j];
+// Finishes an ib x jb tile of op(A) * op(B) whose top left corner is C[i0][j0]
+// in a single pass: every element goes through all enabled stages and is
+// stored once, while the tile is still in registers and L1.
+template <bool Requant>
+void store_tile(const int acc[TILE][TILE], int i0, int j0, int ib, int jb,
+                int alpha, int beta, int *c, int ldc, const Epilogue &epi) {
+    for (int i = 0; i < ib; ++i) {
+        int *c_row = c + (i0 + i) * ldc + j0;
+        for (int j = 0; j < jb; ++j) {
+            int v = alpha * acc[i][j] + (beta ? beta * c_row[j] : 0);
+            v = epilogue_value(v, i0 + i, j0 + j, epi);
+            if (Requant)
+                epi.q[(i0 + i) * ldc + j0 + j] = requantize(v, epi);
+            else
+                c_row[j] = v;
+        }
+    }
+}
+
+// Same contract as xgemm_seq. Each thread computes TILE x TILE blocks of C,
+// loading tiles of op(A) and op(B) in whichever order they are stored, and
+// applies the epilogue to each block before it is written back.
+void xgemm_omp(Layout layout, Transpose trans_a, Transpose trans_b, int m, int n, int k,
+               int alpha, const int *a, int lda, const int *b, int ldb, int beta, int *c, int ldc,
+               const Epilogue &epi = {}) {
+    if (layout == COL_MAJOR) {
+        xgemm_omp(ROW_MAJOR, trans_b, trans_a, n, m, k, alpha, b, ldb, a, lda, beta, c, ldc, transposed(epi));
+        return;
+    }
+    #pragma omp parallel
+    {
+        int a_tile[TILE][TILE], b_tile[TILE][TILE], acc[TILE][TILE];
+        #pragma omp for collapse(2) schedule(static)
+        for (int i0 = 0; i0 < m; i0 += TILE) {
+            for (int j0 = 0; j0 < n; j0 += TILE) {
+                int ib = std::min(TILE, m - i0), jb = std::min(TILE, n - j0);
+                for (int i = 0; i < ib; ++i)
+                    for (int j = 0; j < jb; ++j)
+                        acc[i][j] = 0;
+                for (int p0 = 0; p0 < k; p0 += TILE) {
+                    int pb = std::min(TILE, k - p0);
+                    if (trans_a == TRANS) {
+                        for (int p = 0; p < pb; ++p)
+                            for (int i = 0; i < ib; ++i)
+                                a_tile[i][p] = a[(p0 + p) * lda + i0 + i];
+                    } else {
+                        for (int i = 0; i < ib; ++i)
+                            for (int p = 0; p < pb; ++p)
+                                a_tile[i][p] = a[(i0 + i) * lda + p0 + p];
+                    }
+                    if (trans_b == TRANS) {
+                        for (int j = 0; j < jb; ++j)
+                            for (int p = 0; p < pb; ++p)
+                                b_tile[p][j] = b[(j0 + j) * ldb + p0 + p];
+                    } else {
+                        for (int p = 0; p < pb; ++p)
+                            for (int j = 0; j < jb; ++j)
+                                b_tile[p][j] = b[(p0 + p) * ldb + j0 + j];
+                    }
+                    for (int i = 0; i < ib; ++i) {
+                        for (int p = 0; p < pb; ++p) {
+                            int aip = a_tile[i][p];
+                            for (int j = 0; j < jb; ++j)
+                                acc[i][j] += aip * b_tile[p][j];
+                        }
+                    }
+                }
+                if (epi.q)
+                    store_tile<true>(acc, i0, j0, ib, jb, alpha, beta, c, ldc, epi);
+                else
+                    store_tile<false>(acc, i0, j0, ib, jb, alpha, beta, c, ldc, epi);
             }
         }
     }
 }
 
-void matrix_multiply_gpu_buffers(const Matrix &a, const Matrix &b, Matrix &res, const char *program_name) {
-    cl_int ret = CL_SUCCESS;
-    cl_uint platform_count = 0;
-    CHK(!clGetPlatformIDs(0, nullptr, &platform_count));
+// res = a * b, the same as the OpenCL kernels
+void matrix_multiply_seq(const Matrix &a, const Matrix &b, Matrix &res) {
+    xgemm_seq(ROW_MAJOR, NO_TRANS, NO_TRANS, a.height, b.width, a.width,
+              1, a.data, a.width, b.data, b.width, 0, res.data, res.width);
+}
 
-    cl_platform_id *platforms = (cl_platform_id *) malloc(sizeof(cl_platform_id) * platform_count);
-    CHK(!clGetPlatformIDs(platform_count, platforms, nullptr));
-    for (cl_uint i = 0; i < platform_count; ++i) {
-        char platformName[128];
-        CHK(!clGetPlatformInfo(platforms[i], CL_PLATFORM_NAME, 128, platformName, nullptr));
-    }
-    CHK(platform_count);
+void matrix_multiply_omp(const Matrix &a, const Matrix &b, Matrix &res) {
+    xgemm_omp(ROW_MAJOR, NO_TRANS, NO_TRANS, a.height, b.width, a.width,
+              1, a.data, a.width, b.data, b.width, 0, res.data, res.width);
+}
 
-    cl_context_properties properties[3] = {
-        CL_CONTEXT_PLATFORM, (cl_context_properties) platforms[0], 0
-    };
-    cl_uint device_count = 0;
-    CHK(!clGetDeviceIDs(platforms[0], CL_DEVICE_TYPE_GPU, 0, nullptr, &device_count));
-    CHK(device_count);
-    cl_device_id *devices = (cl_device_id *) malloc(sizeof(cl_device_id) * device_count);
-    CHK(devices);
-    CHK(!clGetDeviceIDs(platforms[0], CL_DEVICE_TYPE_GPU, device_count, devices, nullptr));
-    cl_context context = clCreateContext(nullptr, 1, &devices[0], nullptr, nullptr, &ret);
-    CHK(context);
-
-    cl_mem a_buff = clCreateBuffer(context, CL_MEM_READ_ONLY, sizeof(int) * a.width * a.height, a.data, nullptr);
+KernelCache &matrix_kernels() {
+    static KernelCache cache(cl_env().context, cl_env().device, "lab3.cl");
+    return cache;
+}
+
+double matrix_multiply_gpu_buffers(const Matrix &a, const Matrix &b, Matrix &res, const char *program_name, const Specialization &spec) {
+    ClEnv &env = cl_env();
+
+    cl_mem a_buff = clCreateBuffer(env.context, CL_MEM_READ_ONLY, sizeof(int) * a.width * a.height, nullptr, nullptr);
     CHK(a_buff);
 
-    cl_mem b_buff = clCreateBuffer(context, CL_MEM_READ_ONLY, sizeof(int) * b.width * b.height, b.data, nullptr);
+    cl_mem b_buff = clCreateBuffer(env.context, CL_MEM_READ_ONLY, sizeof(int) * b.width * b.height, nullptr, nullptr);
     CHK(b_buff);
 
-    cl_mem res_buff = clCreateBuffer(context, CL_MEM_WRITE_ONLY, sizeof(int) * res.width * res.height, res.data, nullptr);
+    cl_mem res_buff = clCreateBuffer(env.context, CL_MEM_WRITE_ONLY, sizeof(int) * res.width * res.height, nullptr, nullptr);
     CHK(res_buff);
 
-    cl_command_queue queue = clCreateCommandQueue(context, devices[0], 0, nullptr);
-
     cl_event buff_events[3];
-    CHK(!clEnqueueWriteBuffer(queue, a_buff, CL_FALSE, 0, sizeof(int) * a.width * a.height, a.data, 0, nullptr, &buff_events[0]));
-    CHK(!clEnqueueWriteBuffer(queue, b_buff, CL_FALSE, 0, sizeof(int) * b.width * b.height, b.data, 0, nullptr, &buff_events[1]));
-    CHK(!clEnqueueWriteBuffer(queue, res_buff, CL_FALSE, 0, sizeof(int) * res.width * res.height, res.data, 0, nullptr, &buff_events[2]));
-
-    FILE *kernel_file = fopen("lab3.cl", "r");
-    fseek(kernel_file, 0, SEEK_END);
-    size_t source_len = ftell(kernel_file);
-    fseek(kernel_file, 0, SEEK_SET);
-    char *source = (char *) calloc(1, source_len + 1);
-    fread(source, 1, source_len, kernel_file);
-
-    cl_program program = clCreateProgramWithSource(context, 1, (const char**)&source, &source_len, nullptr);
-    if (clBuildProgram(program, 1, &devices[0], nullptr, nullptr, nullptr) == CL_BUILD_PROGRAM_FAILURE) {
-        size_t log_size;
-        clGetProgramBuildInfo(program, devices[0], CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
-        char *log = (char *) malloc(log_size);
-
-        clGetProgramBuildInfo(program, devices[0], CL_PROGRAM_BUILD_LOG, log_size, log, NULL);
-        fprintf(stderr, "%s\n", log);
-        abort();
-    }
+    CHK(!clEnqueueWriteBuffer(env.queue, a_buff, CL_FALSE, 0, sizeof(int) * a.width * a.height, a.data, 0, nullptr, &buff_events[0]));
+    CHK(!clEnqueueWriteBuffer(env.queue, b_buff, CL_FALSE, 0, sizeof(int) * b.width * b.height, b.data, 0, nullptr, &buff_events[1]));
+    CHK(!clEnqueueWriteBuffer(env.queue, res_buff, CL_FALSE, 0, sizeof(int) * res.width * res.height, res.data, 0, nullptr, &buff_events[2]));
 
-    cl_kernel kernel = clCreateKernel(program, program_name, nullptr);
+    cl_kernel kernel = matrix_kernels().get(program_name, spec);
 
     CHK(!clSetKernelArg(kernel, 0, sizeof(cl_mem), &a_buff));
     CHK(!clSetKernelArg(kernel, 1, sizeof(cl_mem), &b_buff));
     CHK(!clSetKernelArg(kernel, 2, sizeof(cl_mem), &res_buff));
-    CHK(!clSetKernelArg(kernel, 3, sizeof(int), &a.width));
-    CHK(!clSetKernelArg(kernel, 4, sizeof(int), &b.width));
-    CHK(!clSetKernelArg(kernel, 5, sizeof(int), &b.height));
+    CHK(!clSetKernelArg(kernel, 3, sizeof(int), &a.height));
+    CHK(!clSetKernelArg(kernel, 4, sizeof(int), &a.width));
+    CHK(!clSetKernelArg(kernel, 5, sizeof(int), &b.width));
 
-    const size_t global_work_size[2] = {size_t(a.width), size_t(b.height)};
+    const size_t global_work_size[2] = {size_t(b.width), size_t(a.height)};
     const size_t local_work_size[2] = {BLOCK_SIZE, BLOCK_SIZE};
 
     printf("Started kernel\n");
-    double start = omp_get_wtime();
-    CHK(!clEnqueueNDRangeKernel(queue, kernel, 2, nullptr, global_work_size, local_work_size, 3, buff_events, nullptr));
-    CHK(!clFinish(queue));
-    double finish = omp_get_wtime();
-    printf("Kernel execution time: %lf\n", finish - start);
+    cl_event kernel_event;
+    CHK(!clEnqueueNDRangeKernel(env.queue, kernel, 2, nullptr, global_work_size, local_work_size, 3, buff_events, &kernel_event));
+    CHK(!clFinish(env.queue));
+    double kernel_time = event_seconds(kernel_event);
+    printf("Kernel execution time: %lf\n", kernel_time);
 
-    CHK(!clEnqueueReadBuffer(queue, res_buff, CL_TRUE, 0, sizeof(int) * res.width * res.height, res.data, 0, nullptr, nullptr));
+    CHK(!clEnqueueReadBuffer(env.queue, res_buff, CL_TRUE, 0, sizeof(int) * res.width * res.height, res.data, 0, nullptr, nullptr));
 
-    free(source);
+    for (cl_event event : buff_events)
+        CHK(!clReleaseEvent(event));
+    CHK(!clReleaseEvent(kernel_event));
     CHK(!clReleaseMemObject(a_buff));
     CHK(!clReleaseMemObject(b_buff));
     CHK(!clReleaseMemObject(res_buff));
-    CHK(!clReleaseProgram(program));
-    CHK(!clReleaseKernel(kernel));
-    CHK(!clReleaseCommandQueue(queue));
-    CHK(!clReleaseContext(context));
+    return kernel_time;
 }
 
-void matrix_multiply_gpu_images(const Matrix &a, const Matrix &b, Matrix &res, const char *program_name) {
-    cl_int ret = CL_SUCCESS;
-    cl_uint platform_count = 0;
-    CHK(!clGetPlatformIDs(0, nullptr, &platform_count));
-
-    cl_platform_id *platforms = (cl_platform_id *) malloc(sizeof(cl_platform_id) * platform_count);
-    CHK(!clGetPlatformIDs(platform_count, platforms, nullptr));
-    for (cl_uint i = 0; i < platform_count; ++i) {
-        char platformName[128];
-        CHK(!clGetPlatformInfo(platforms[i], CL_PLATFORM_NAME, 128, platformName, nullptr));
-    }
-    CHK(platform_count);
-
-    cl_context_properties properties[3] = {
-        CL_CONTEXT_PLATFORM, (cl_context_properties) platforms[0], 0
-    };
-    cl_uint device_count = 0;
-    CHK(!clGetDeviceIDs(platforms[0], CL_DEVICE_TYPE_GPU, 0, nullptr, &device_count));
-    CHK(device_count);
-    cl_device_id *devices = (cl_device_id *) malloc(sizeof(cl_device_id) * device_count);
-    CHK(devices);
-    CHK(!clGetDeviceIDs(platforms[0], CL_DEVICE_TYPE_GPU, device_count, devices, nullptr));
-    cl_context context = clCreateContext(nullptr, 1, &devices[0], nullptr, nullptr, &ret);
-    CHK(context);
+double matrix_multiply_gpu_images(const Matrix &a, const Matrix &b, Matrix &res, const char *program_name, const Specialization &spec) {
+    ClEnv &env = cl_env();
 
     cl_image_format form;
     form.image_channel_order = CL_R;
     form.image_channel_data_type = CL_SIGNED_INT32;
 
-    cl_mem a_buff = clCreateImage2D(context, CL_MEM_READ_ONLY, &form, a.width, a.height, 0, a.data, nullptr);
+    cl_mem a_buff = clCreateImage2D(env.context, CL_MEM_READ_ONLY, &form, a.width, a.height, 0, nullptr, nullptr);
     CHK(a_buff);
 
-    cl_mem b_buff = clCreateImage2D(context, CL_MEM_READ_ONLY, &form, b.width, b.height, 0, b.data, nullptr);
+    cl_mem b_buff = clCreateImage2D(env.context, CL_MEM_READ_ONLY, &form, b.width, b.height, 0, nullptr, nullptr);
     CHK(b_buff);
 
-    cl_mem res_buff = clCreateImage2D(context, CL_MEM_WRITE_ONLY, &form, res.width, res.height, 0, res.data, nullptr);
+    cl_mem res_buff = clCreateImage2D(env.context, CL_MEM_WRITE_ONLY, &form, res.width, res.height, 0, nullptr, nullptr);
     CHK(res_buff);
 
-    cl_command_queue queue = clCreateCommandQueue(context, devices[0], 0, nullptr);
-
     cl_event img_events[3];
     size_t origin[3] = {0, 0, 0};
     size_t region[3] = {0, 0, 1};
     region[0] = a.width; region[1] = a.height;
-    CHK(!clEnqueueWriteImage(queue, a_buff, CL_FALSE, origin, region, 0, 0, a.data, 0, nullptr, &img_events[0]));
+    CHK(!clEnqueueWriteImage(env.queue, a_buff, CL_FALSE, origin, region, 0, 0, a.data, 0, nullptr, &img_events[0]));
     region[0] = b.width; region[1] = b.height;
-    CHK(!clEnqueueWriteImage(queue, b_buff, CL_FALSE, origin, region, 0, 0, b.data, 0, nullptr, &img_events[1]));
+    CHK(!clEnqueueWriteImage(env.queue, b_buff, CL_FALSE, origin, region, 0, 0, b.data, 0, nullptr, &img_events[1]));
     region[0] = res.width; region[1] = res.height;
-    CHK(!clEnqueueWriteImage(queue, res_buff, CL_FALSE, origin, region, 0, 0, res.data, 0, nullptr, &img_events[2]));
-
-    FILE *kernel_file = fopen("lab3.cl", "r");
-    fseek(kernel_file, 0, SEEK_END);
-    size_t source_len = ftell(kernel_file);
-    fseek(kernel_file, 0, SEEK_SET);
-    char *source = (char *) calloc(1, source_len + 1);
-    fread(source, 1, source_len, kernel_file);
-
-    cl_program program = clCreateProgramWithSource(context, 1, (const char**)&source, &source_len, nullptr);
-    if (clBuildProgram(program, 1, &devices[0], nullptr, nullptr, nullptr) == CL_BUILD_PROGRAM_FAILURE) {
-        size_t log_size;
-        clGetProgramBuildInfo(program, devices[0], CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
-        char *log = (char *) malloc(log_size);
-
-        clGetProgramBuildInfo(program, devices[0], CL_PROGRAM_BUILD_LOG, log_size, log, NULL);
-        fprintf(stderr, "%s\n", log);
-        abort();
-    }
+    CHK(!clEnqueueWriteImage(env.queue, res_buff, CL_FALSE, origin, region, 0, 0, res.data, 0, nullptr, &img_events[2]));
 
-    cl_kernel kernel = clCreateKernel(program, program_name, nullptr);
+    cl_kernel kernel = matrix_kernels().get(program_name, spec);
 
     CHK(!clSetKernelArg(kernel, 0, sizeof(cl_mem), &a_buff));
     CHK(!clSetKernelArg(kernel, 1, sizeof(cl_mem), &b_buff));
     CHK(!clSetKernelArg(kernel, 2, sizeof(cl_mem), &res_buff));
-    CHK(!clSetKernelArg(kernel, 3, sizeof(int), &a.width));
-    CHK(!clSetKernelArg(kernel, 4, sizeof(int), &b.width));
-    CHK(!clSetKernelArg(kernel, 5, sizeof(int), &b.height));
+    CHK(!clSetKernelArg(kernel, 3, sizeof(int), &a.height));
+    CHK(!clSetKernelArg(kernel, 4, sizeof(int), &a.width));
+    CHK(!clSetKernelArg(kernel, 5, sizeof(int), &b.width));
 
-    const size_t global_work_size[2] = {size_t(a.width), size_t(b.height)};
+    const size_t global_work_size[2] = {size_t(b.width), size_t(a.height)};
     const size_t local_work_size[2] = {BLOCK_SIZE, BLOCK_SIZE};
 
     printf("Started kernel\n");
-    double start = omp_get_wtime();
-    CHK(!clEnqueueNDRangeKernel(queue, kernel, 2, nullptr, global_work_size, local_work_size, 3, img_events, nullptr));
-    CHK(!clFinish(queue));
-    double finish = omp_get_wtime();
-    printf("Kernel execution time: %lf\n", finish - start);
+    cl_event kernel_event;
+    CHK(!clEnqueueNDRangeKernel(env.queue, kernel, 2, nullptr, global_work_size, local_work_size, 3, img_events, &kernel_event));
+    CHK(!clFinish(env.queue));
+    double kernel_time = event_seconds(kernel_event);
+    printf("Kernel execution time: %lf\n", kernel_time);
 
-    CHK(!clEnqueueReadImage(queue, res_buff, CL_TRUE, origin, region, 0, 0, res.data, 0, nullptr, nullptr));
+    CHK(!clEnqueueReadImage(env.queue, res_buff, CL_TRUE, origin, region, 0, 0, res.data, 0, nullptr, nullptr));
 
-    free(source);
+    for (cl_event event : img_events)
+        CHK(!clReleaseEvent(event));
+    CHK(!clReleaseEvent(kernel_event));
     CHK(!clReleaseMemObject(a_buff));
     CHK(!clReleaseMemObject(b_buff));
     CHK(!clReleaseMemObject(res_buff));
-    CHK(!clReleaseProgram(program));
-    CHK(!clReleaseKernel(kernel));
-    CHK(!clReleaseCommandQueue(queue));
-    CHK(!clReleaseContext(context));
+    return kernel_time;
 }
 
-void validate_results(const char *name, Matrix &actual, Matrix &reference) {
-    if (actual.width * actual.height != reference.width * reference.height) {
-        printf("ERROR: '%s' wrong result!!!\n", name);
-        return;
+// Elements spanned by a rows x cols view with leading dimension ld.
+size_t view_extent(Layout layout, int rows, int cols, int ld) {
+    int outer = layout == ROW_MAJOR ? rows : cols;
+    int inner = layout == ROW_MAJOR ? cols : rows;
+    return outer && inner ? size_t(outer - 1) * ld + inner : 0;
+}
+
+// Same contract as xgemm_seq; transposed operands are read in place by the
+// TRANS_A / TRANS_B variants of the xgemm kernel, and only the epilogue
+// stages in use are compiled into the variant that runs.
+double xgemm_gpu(Layout layout, Transpose trans_a, Transpose trans_b, int m, int n, int k,
+                 int alpha, const int *a, int lda, const int *b, int ldb, int beta, int *c, int ldc,
+                 const Epilogue &epi = {}) {
+    if (layout == COL_MAJOR)
+        return xgemm_gpu(ROW_MAJOR, trans_b, trans_a, n, m, k, alpha, b, ldb, a, lda, beta, c, ldc, transposed(epi));
+    if (m == 0 || n == 0)
+        return 0;
+    if (k == 0) {
+        // Only the epilogue is left, and OpenCL has no empty buffers for A and B
+        xgemm_seq(ROW_MAJOR, trans_a, trans_b, m, n, k, alpha, a, lda, b, ldb, beta, c, ldc, epi);
+        return 0;
     }
-    bool f = true;
-    #pragma omp parallel for
-    for (int i = 0; i < actual.width * actual.height; ++i) {
-        f &= (actual.data[i] == reference.data[i]);
+    ClEnv &env = cl_env();
+    size_t a_count = trans_a == TRANS ? view_extent(ROW_MAJOR, k, m, lda) : view_extent(ROW_MAJOR, m, k, lda);
+    size_t b_count = trans_b == TRANS ? view_extent(ROW_MAJOR, n, k, ldb) : view_extent(ROW_MAJOR, k, n, ldb);
+    size_t c_count = view_extent(ROW_MAJOR, m, n, ldc);
+    // C is read for beta and otherwise written. Whole output rows go both
+    // ways so that the gaps between rows of a sub-block view come back unchanged.
+    bool use_c = beta || !epi.q;
+
+    std::vector<cl_event> buff_events;
+    auto upload = [&](const void *data, size_t bytes, cl_mem_flags flags) {
+        cl_mem buff = clCreateBuffer(env.context, flags, bytes, nullptr, nullptr);
+        CHK(buff);
+        buff_events.emplace_back();
+        CHK(!clEnqueueWriteBuffer(env.queue, buff, CL_FALSE, 0, bytes, data, 0, nullptr, &buff_events.back()));
+        return buff;
+    };
+    cl_mem a_buff = upload(a, sizeof(int) * a_count, CL_MEM_READ_ONLY);
+    cl_mem b_buff = upload(b, sizeof(int) * b_count, CL_MEM_READ_ONLY);
+    cl_mem c_buff = use_c ? upload(c, sizeof(int) * c_count, CL_MEM_READ_WRITE) : nullptr;
+    cl_mem row_bias_buff = epi.row_bias ? upload(epi.row_bias, sizeof(int) * m, CL_MEM_READ_ONLY) : nullptr;
+    cl_mem col_bias_buff = epi.col_bias ? upload(epi.col_bias, sizeof(int) * n, CL_MEM_READ_ONLY) : nullptr;
+    cl_mem q_buff = epi.q ? upload(epi.q, sizeof(int8_t) * c_count, CL_MEM_READ_WRITE) : nullptr;
+
+    Specialization spec;
+    if (trans_a == TRANS)
+        spec["TRANS_A"] = 1;
+    if (trans_b == TRANS)
+        spec["TRANS_B"] = 1;
+    if (alpha != 1)
+        spec["EPI_ALPHA"] = 1;
+    if (beta)
+        spec["EPI_BETA"] = 1;
+    if (epi.row_bias)
+        spec["EPI_ROW_BIAS"] = 1;
+    if (epi.col_bias)
+        spec["EPI_COL_BIAS"] = 1;
+    if (epi.relu)
+        spec["EPI_RELU"] = 1;
+    if (epi.clamp)
+        spec["EPI_CLAMP"] = 1;
+    if (epi.q)
+        spec["EPI_REQUANT"] = 1;
+    cl_kernel kernel = matrix_kernels().get("xgemm", spec);
+
+    CHK(!clSetKernelArg(kernel, 0, sizeof(int), &m));
+    CHK(!clSetKernelArg(kernel, 1, sizeof(int), &n));
+    CHK(!clSetKernelArg(kernel, 2, sizeof(int), &k));
+    CHK(!clSetKernelArg(kernel, 3, sizeof(int), &alpha));
+    CHK(!clSetKernelArg(kernel, 4, sizeof(cl_mem), &a_buff));
+    CHK(!clSetKernelArg(kernel, 5, sizeof(int), &lda));
+    CHK(!clSetKernelArg(kernel, 6, sizeof(cl_mem), &b_buff));
+    CHK(!clSetKernelArg(kernel, 7, sizeof(int), &ldb));
+    CHK(!clSetKernelArg(kernel, 8, sizeof(int), &beta));
+    CHK(!clSetKernelArg(kernel, 9, sizeof(cl_mem), &c_buff));
+    CHK(!clSetKernelArg(kernel, 10, sizeof(int), &ldc));
+    CHK(!clSetKernelArg(kernel, 11, sizeof(cl_mem), &row_bias_buff));
+    CHK(!clSetKernelArg(kernel, 12, sizeof(cl_mem), &col_bias_buff));
+    CHK(!clSetKernelArg(kernel, 13, sizeof(int), &epi.clamp_min));
+    CHK(!clSetKernelArg(kernel, 14, sizeof(int), &epi.clamp_max));
+    CHK(!clSetKernelArg(kernel, 15, sizeof(int), &epi.quant_multiplier));
+    CHK(!clSetKernelArg(kernel, 16, sizeof(int), &epi.quant_shift));
+    CHK(!clSetKernelArg(kernel, 17, sizeof(int), &epi.quant_zero_point));
+    CHK(!clSetKernelArg(kernel, 18, sizeof(cl_mem), &q_buff));
+
+    const size_t global_work_size[2] = {
+        size_t(n + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE,
+        size_t(m + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE,
+    };
+    const size_t local_work_size[2] = {BLOCK_SIZE, BLOCK_SIZE};
+
+    cl_event kernel_event;
+    CHK(!clEnqueueNDRangeKernel(env.queue, kernel, 2, nullptr, global_work_size, local_work_size,
+                                buff_events.size(), buff_events.data(), &kernel_event));
+    CHK(!clFinish(env.queue));
+    double kernel_time = event_seconds(kernel_event);
+
+    if (epi.q) {
+        CHK(!clEnqueueReadBuffer(env.queue, q_buff, CL_TRUE, 0, sizeof(int8_t) * c_count, epi.q, 0, nullptr, nullptr));
+    } else {
+        CHK(!clEnqueueReadBuffer(env.queue, c_buff, CL_TRUE, 0, sizeof(int) * c_count, c, 0, nullptr, nullptr));
     }
-    if (!f) {
+
+    for (cl_event event : buff_events)
+        CHK(!clReleaseEvent(event));
+    CHK(!clReleaseEvent(kernel_event));
+    for (cl_mem buff : {a_buff, b_buff, c_buff, row_bias_buff, col_bias_buff, q_buff}) {
+        if (buff)
+            CHK(!clReleaseMemObject(buff));
+    }
+    return kernel_time;
+}
+
+bool use_freivalds = false;
+
+// Checks res == a * b. By default the product is recomputed a block of rows
+// at a time; with `use_freivalds` it is checked probabilistically in O(n^2).
+void validate_results(const char *name, const Matrix &a, const Matrix &b, const Matrix &res) {
+    if (a.width != b.height || res.width < b.width || res.height < a.height) {
         printf("ERROR: '%s' wrong result!!!\n", name);
+        return;
+    }
+    if (use_freivalds) {
+        if (freivalds_check(a.data, b.data, res.data, a.height, a.width, b.width, a.width, b.width, res.width)) {
+            printf("'%s' verified (Freivalds)\n", name);
+        } else {
+            printf("ERROR: '%s' wrong result!!!\n", name);
+        }
+        return;
     }
+    size_t chunk = size_t(res.width) * std::max<size_t>(1, VERIFY_CHUNK / res.width);
+    size_t rows = a.height, inner = a.width;
+    VerifyReport report = verify_stream(res.data, size_t(res.width) * res.height, [&](size_t begin, size_t end, int *ref) {
+        for (size_t idx = begin; idx < end; ++idx)
+            ref[idx - begin] = 0;
+        for (size_t i = begin / res.width; i <= (end - 1) / res.width && i < rows; ++i) {
+            size_t row = i * res.width;
+            size_t j_begin = std::max(row, begin) - row;
+            size_t j_end = std::min<size_t>(std::min(row + res.width, end) - row, b.width);
+            int *out = ref + row - begin;
+            for (size_t k = 0; k < inner; ++k) {
+                int aik = a.data[i * inner + k];
+                for (size_t j = j_begin; j < j_end; ++j)
+                    out[j] += aik * b.data[k * b.width + j];
+            }
+        }
+    }, default_tolerance<int>(), chunk);
+    print_report(name, report);
 }
 
 void matrix_fill_random(Matrix a) {
@@ -260,42 +481,328 @@ void matrix_fill_random(Matrix a) {
     }
 }
 
+// Times the generic `program_name` kernel against variants with the
+// matrix dimensions baked in.
+void bench_variants(const char *name, const Matrix &a, const Matrix &b, Matrix &res, const char *program_name) {
+    const std::pair<const char *, Specialization> variants[] = {
+        {"generic", {}},
+        {"inner", {{"M", a.width}}},
+        {"full", {{"N", a.height}, {"M", a.width}, {"L", b.width}}},
+    };
+    double generic_time = 0;
+    for (const auto &[variant, spec] : variants) {
+        double kernel_time = matrix_multiply_gpu_buffers(a, b, res, program_name, spec);
+        if (spec.empty())
+            generic_time = kernel_time;
+        printf("%s[%s] kernel time: %lf, speedup: %.2fx\n", name, variant, kernel_time, generic_time / kernel_time);
+        char variant_name[64];
+        snprintf(variant_name, sizeof(variant_name), "%s[%s]", name, variant);
+        report_roofline(variant_name, kernel_time, gemm_work(a.height, b.width, a.width), device_roof());
+        validate_results(name, a, b, res);
+    }
+}
+
 #define NEW_MAT(w, h) {                         \
     .width = w,                                 \
     .height = h,                                \
     .data = (int *)calloc(w * h, sizeof(int)),  \
 }
 
+// matrix_multiply_gpu_buffers with the rows of a and res split into one
+// block per shard. Every shard gets its own copy of b, and all of its
+// buffers prefer its NUMA node, if known. Returns the time from the first launch
+// until every shard has finished.
+double matrix_multiply_sharded(ClShards &shards, const Matrix &a, const Matrix &b, Matrix &res, const char *program_name) {
+    std::vector<std::pair<size_t, size_t>> ranges = shards.split(a.height, BLOCK_SIZE);
+    std::vector<std::unique_ptr<NodeBuffer>> a_buffs(shards.size()), b_buffs(shards.size()), res_buffs(shards.size());
+    size_t b_size = sizeof(int) * b.width * b.height;
+    for (size_t s = 0; s < shards.size(); ++s) {
+        auto [begin, end] = ranges[s];
+        if (begin == end)
+            continue;
+        size_t a_size = sizeof(int) * (end - begin) * a.width, res_size = sizeof(int) * (end - begin) * res.width;
+        a_buffs[s] = std::make_unique<NodeBuffer>(shards.context, CL_MEM_READ_ONLY, a_size, shards.nodes[s]);
+        b_buffs[s] = std::make_unique<NodeBuffer>(shards.context, CL_MEM_READ_ONLY, b_size, shards.nodes[s]);
+        res_buffs[s] = std::make_unique<NodeBuffer>(shards.context, CL_MEM_WRITE_ONLY, res_size, shards.nodes[s]);
+        CHK(!clEnqueueWriteBuffer(shards.queues[s], a_buffs[s]->mem, CL_FALSE, 0, a_size, a.data + begin * a.width, 0, nullptr, nullptr));
+        CHK(!clEnqueueWriteBuffer(shards.queues[s], b_buffs[s]->mem, CL_FALSE, 0, b_size, b.data, 0, nullptr, nullptr));
+    }
+    shards.finish();
+
+    double start = omp_get_wtime();
+    for (size_t s = 0; s < shards.size(); ++s) {
+        auto [begin, end] = ranges[s];
+        if (begin == end)
+            continue;
+        cl_kernel kernel = shards.kernel(s, program_name);
+        int rows = end - begin;
+        CHK(!clSetKernelArg(kernel, 0, sizeof(cl_mem), &a_buffs[s]->mem));
+        CHK(!clSetKernelArg(kernel, 1, sizeof(cl_mem), &b_buffs[s]->mem));
+        CHK(!clSetKernelArg(kernel, 2, sizeof(cl_mem), &res_buffs[s]->mem));
+        CHK(!clSetKernelArg(kernel, 3, sizeof(int), &rows));
+        CHK(!clSetKernelArg(kernel, 4, sizeof(int), &a.width));
+        CHK(!clSetKernelArg(kernel, 5, sizeof(int), &b.width));
+        const size_t global_work_size[2] = {size_t(b.width), size_t(rows)};
+        const size_t local_work_size[2] = {BLOCK_SIZE, BLOCK_SIZE};
+        CHK(!clEnqueueNDRangeKernel(shards.queues[s], kernel, 2, nullptr, global_work_size, local_work_size, 0, nullptr, nullptr));
+        CHK(!clFlush(shards.queues[s]));
+    }
+    shards.finish();
+    double kernel_time = omp_get_wtime() - start;
+
+    for (size_t s = 0; s < shards.size(); ++s) {
+        auto [begin, end] = ranges[s];
+        if (begin == end)
+            continue;
+        CHK(!clEnqueueReadBuffer(shards.queues[s], res_buffs[s]->mem, CL_TRUE, 0, res_buffs[s]->bytes,
+                                 res.data + begin * res.width, 0, nullptr, nullptr));
+    }
+    return kernel_time;
+}
+
+// matrix_multiply_sharded on the whole CPU device and on its sub-devices,
+// with res cleared first so a stale result cannot pass validation.
+void bench_shards(const char *name, const Matrix &a, const Matrix &b, Matrix &res, const char *program_name) {
+    compare_shards(name, "lab3.cl", gemm_work(a.height, b.width, a.width), host_roof<int>(), [&](ClShards &shards) {
+        memset(res.data, 0, sizeof(int) * res.width * res.height);
+        return matrix_multiply_sharded(shards, a, b, res, program_name);
+    }, [&] { validate_results(name, a, b, res); });
+}
+
 void matrix_test() {
     // constexpr int n = 640, m = 640, l = 640;
     constexpr int n = 800, m = 640, l = 800;
     // constexpr int n = 960, m = 960, l = 960;
     // constexpr int n = 128, m = 128, l = 128;
     static_assert(n % BLOCK_SIZE == 0 && m % BLOCK_SIZE == 0 && l % BLOCK_SIZE == 0);
-    Matrix mat1 = NEW_MAT(n, m);
-    Matrix mat2 = NEW_MAT(m, l);
-    Matrix mat3 = NEW_MAT(n, l);
-    Matrix mat4 = NEW_MAT(n, l);
-    Matrix mat5 = NEW_MAT(n, l);
-    Matrix mat6 = NEW_MAT(n, l);
-    Matrix mat7 = NEW_MAT(n, l);
+    // mat1 is n x m, mat2 is m x l, the results are n x l
+    Matrix mat1 = NEW_MAT(m, n);
+    Matrix mat2 = NEW_MAT(l, m);
+    Matrix mat3 = NEW_MAT(l, n);
+    Matrix mat4 = NEW_MAT(l, n);
+    Matrix mat5 = NEW_MAT(l, n);
+    Matrix mat6 = NEW_MAT(l, n);
+    Matrix mat7 = NEW_MAT(l, n);
+    srand(42);
+    matrix_fill_random(mat1);
+    matrix_fill_random(mat2);
+    Work work = gemm_work(n, l, m);
     printf("------------------------------------------------\n");
-    bench("seq", 3, matrix_multiply_seq, mat1, mat2, mat3);
+    bench("seq", 3, host_roof<int>(), work, matrix_multiply_seq, mat1, mat2, mat3);
+    validate_results("seq", mat1, mat2, mat3);
     printf("------------------------------------------------\n");
-    bench("omp", 3, matrix_multiply_omp, mat1, mat2, mat4);
-    validate_results("omp", mat3, mat4);
+    bench("omp", 3, host_roof<int>(), work, matrix_multiply_omp, mat1, mat2, mat4);
+    validate_results("omp", mat1, mat2, mat4);
     printf("------------------------------------------------\n");
-    bench("gpu_naive", 3, matrix_multiply_gpu_buffers, mat1, mat2, mat5, "matrix_multiply_naive");
-    validate_results("gpu_naive", mat3, mat5);
-    printf("------------------------------------------------\n");
-    bench("gpu_optimized", 3, matrix_multiply_gpu_buffers, mat1, mat2, mat6, "matrix_multiply_optimized");
-    validate_results("gpu_optimized", mat3, mat6);
+    if (has_gpu()) {
+        bench_kernel("gpu_naive", 3, work, matrix_multiply_gpu_buffers, mat1, mat2, mat5, "matrix_multiply_naive", Specialization{});
+        validate_results("gpu_naive", mat1, mat2, mat5);
+        printf("------------------------------------------------\n");
+        bench_kernel("gpu_optimized", 3, work, matrix_multiply_gpu_buffers, mat1, mat2, mat6, "matrix_multiply_optimized", Specialization{});
+        validate_results("gpu_optimized", mat1, mat2, mat6);
+        printf("------------------------------------------------\n");
+        bench_variants("gpu_naive", mat1, mat2, mat5, "matrix_multiply_naive");
+        bench_variants("gpu_optimized", mat1, mat2, mat6, "matrix_multiply_optimized");
+    } else {
+        printf("No GPU OpenCL device, skipping the GPU runs\n");
+    }
     printf("------------------------------------------------\n");
-    bench("gpu_images", 3, matrix_multiply_gpu_images, mat1, mat2, mat7, "matrix_multiply_images");
-    validate_results("gpu_images", mat3, mat7);
+    bench_shards("gpu_naive", mat1, mat2, mat5, "matrix_multiply_naive");
+    bench_shards("gpu_optimized", mat1, mat2, mat6, "matrix_multiply_optimized");
+    if (has_gpu()) {
+        printf("------------------------------------------------\n");
+        bench_kernel("gpu_images", 3, work, matrix_multiply_gpu_images, mat1, mat2, mat7, "matrix_multiply_images", Specialization{});
+        validate_results("gpu_images", mat1, mat2, mat7);
+    }
+}
+
+// Runs every layout, transpose and epilogue combination on sub-blocks of
+// larger buffers, so the leading dimensions differ from the view sizes, and
+// checks the output inside the view and that everything around it is untouched.
+void xgemm_test() {
+    constexpr int m = 200, n = 152, k = 120, alpha = 2, beta = 3;
+    // Views start at line 1, element 2 of their parent buffer
+    constexpr int pad = 5, offset_lines = 1, offset = 2;
+    const char *layout_names[] = {"row", "col"};
+    const char *trans_names[] = {"N", "T"};
+    using Gemm = double (*)(Layout, Transpose, Transpose, int, int, int, int, const int *, int, const int *, int, int, int *, int,
+                            const Epilogue &);
+    struct Impl {
+        const char *name;
+        Gemm gemm;
+        bool on_device;  // returns its kernel time, reported against the device roof
+    };
+    const Impl impls[] = {
+        {"xgemm_seq", [](Layout l, Transpose ta, Transpose tb, int m, int n, int k, int alpha, const int *a, int lda,
+                         const int *b, int ldb, int beta, int *c, int ldc, const Epilogue &epi) {
+            xgemm_seq(l, ta, tb, m, n, k, alpha, a, lda, b, ldb, beta, c, ldc, epi);
+            return 0.0;
+        }, false},
+        {"xgemm_omp", [](Layout l, Transpose ta, Transpose tb, int m, int n, int k, int alpha, const int *a, int lda,
+                         const int *b, int ldb, int beta, int *c, int ldc, const Epilogue &epi) {
+            xgemm_omp(l, ta, tb, m, n, k, alpha, a, lda, b, ldb, beta, c, ldc, epi);
+            return 0.0;
+        }, false},
+        {"xgemm_gpu", xgemm_gpu, true},
+    };
+
+    int row_bias[m], col_bias[n];
+    for (int &v : row_bias)
+        v = rand() % 100001 - 50000;
+    for (int &v : col_bias)
+        v = rand() % 100001 - 50000;
+    Epilogue activation;
+    activation.row_bias = row_bias;
+    activation.col_bias = col_bias;
+    activation.relu = true;
+    activation.clamp = true;
+    activation.clamp_min = -1000;
+    activation.clamp_max = 1500000;
+    Epilogue quantized;
+    quantized.col_bias = col_bias;
+    quantized.quant_multiplier = 3;
+    quantized.quant_shift = 15;
+    quantized.quant_zero_point = -3;
+    struct EpilogueCase {
+        const char *name;
+        Epilogue epi;
+        bool requant;  // store int8 into q instead of C
+    };
+    const EpilogueCase epilogues[] = {{"plain", {}, false}, {"activation", activation, false}, {"requant", quantized, true}};
+
+    for (Layout layout : {ROW_MAJOR, COL_MAJOR}) {
+        for (Transpose trans_a : {NO_TRANS, TRANS}) {
+            for (Transpose trans_b : {NO_TRANS, TRANS}) {
+                // Lines are rows for row-major storage and columns otherwise
+                auto lines = [&](int rows, int cols) { return layout == ROW_MAJOR ? rows : cols; };
+                auto line_len = [&](int rows, int cols) { return layout == ROW_MAJOR ? cols : rows; };
+                int a_rows = trans_a == TRANS ? k : m, a_cols = trans_a == TRANS ? m : k;
+                int b_rows = trans_b == TRANS ? n : k, b_cols = trans_b == TRANS ? k : n;
+                int lda = line_len(a_rows, a_cols) + pad;
+                int ldb = line_len(b_rows, b_cols) + pad;
+                int ldc = line_len(m, n) + pad;
+                size_t a_size = size_t(lines(a_rows, a_cols) + offset_lines) * lda;
+                size_t b_size = size_t(lines(b_rows, b_cols) + offset_lines) * ldb;
+                size_t c_size = size_t(lines(m, n) + offset_lines) * ldc;
+                int *a_parent = (int *) malloc(sizeof(int) * a_size);
+                int *b_parent = (int *) malloc(sizeof(int) * b_size);
+                int *c_parent = (int *) malloc(sizeof(int) * c_size);
+                int8_t *q_parent = (int8_t *) malloc(sizeof(int8_t) * c_size);
+                CHK(a_parent && b_parent && c_parent && q_parent);
+                for (size_t i = 0; i < a_size; ++i)
+                    a_parent[i] = rand() % 100;
+                for (size_t i = 0; i < b_size; ++i)
+                    b_parent[i] = rand() % 100;
+                const int *a = a_parent + offset_lines * lda + offset;
+                const int *b = b_parent + offset_lines * ldb + offset;
+                int *c = c_parent + offset_lines * ldc + offset;
+
+                auto at = [&](const int *x, int ld, int row, int col) {
+                    return layout == ROW_MAJOR ? x[row * ld + col] : x[col * ld + row];
+                };
+                auto c_init = [](size_t idx) { return int(idx % 7); };
+                // Element (i, j) of C for a parent index inside the view
+                auto view_index = [&](size_t idx, int &i, int &j) {
+                    long line = long(idx / ldc) - offset_lines, pos = long(idx % ldc) - offset;
+                    if (line < 0 || line >= lines(m, n) || pos < 0 || pos >= line_len(m, n))
+                        return false;
+                    i = layout == ROW_MAJOR ? line : pos;
+                    j = layout == ROW_MAJOR ? pos : line;
+                    return true;
+                };
+                auto expected = [&](size_t idx, int i, int j, const Epilogue &epi) {
+                    int res = 0;
+                    for (int p = 0; p < k; ++p) {
+                        int a_ip = trans_a == TRANS ? at(a, lda, p, i) : at(a, lda, i, p);
+                        int b_pj = trans_b == TRANS ? at(b, ldb, j, p) : at(b, ldb, p, j);
+                        res += a_ip * b_pj;
+                    }
+                    // The epilogue is spelled out here rather than taken from
+                    // epilogue_value(), so the check does not share its bugs
+                    int v = alpha * res + beta * c_init(idx);
+                    if (epi.row_bias)
+                        v += epi.row_bias[i];
+                    if (epi.col_bias)
+                        v += epi.col_bias[j];
+                    if (epi.relu && v < 0)
+                        v = 0;
+                    if (epi.clamp)
+                        v = v < epi.clamp_min ? epi.clamp_min : v > epi.clamp_max ? epi.clamp_max : v;
+                    return v;
+                };
+                // Likewise independent of requantize(): round half up, shift,
+                // add the zero point and saturate to int8
+                auto expected_q = [](int v, const Epilogue &epi) {
+                    int64_t scaled = int64_t(v) * epi.quant_multiplier;
+                    if (epi.quant_shift > 0)
+                        scaled = (scaled + (int64_t(1) << (epi.quant_shift - 1))) >> epi.quant_shift;
+                    scaled += epi.quant_zero_point;
+                    return int8_t(scaled < -128 ? -128 : scaled > 127 ? 127 : scaled);
+                };
+
+                for (const auto &[epi_name, epi_config, requant] : epilogues) {
+                    Epilogue epi = epi_config;
+                    if (requant)
+                        epi.q = q_parent + offset_lines * ldc + offset;
+                    for (const auto &[impl_name, gemm, on_device] : impls) {
+                        if (on_device && !has_gpu())
+                            continue;
+                        char name[96];
+                        snprintf(name, sizeof(name), "%s[%s,%s,%s,%s]", impl_name, layout_names[layout],
+                                 trans_names[trans_a], trans_names[trans_b], epi_name);
+                        for (size_t i = 0; i < c_size; ++i) {
+                            c_parent[i] = c_init(i);
+                            q_parent[i] = 0;
+                        }
+                        if (on_device)
+                            bench_kernel(name, 1, gemm_work(m, n, k), gemm, layout, trans_a, trans_b, m, n, k, alpha, a, lda, b, ldb, beta, c, ldc, epi);
+                        else
+                            bench(name, 1, host_roof<int>(), gemm_work(m, n, k), gemm, layout, trans_a, trans_b, m, n, k, alpha, a, lda, b, ldb, beta, c, ldc, epi);
+                        VerifyReport c_report = verify_stream(c_parent, c_size, [&](size_t begin, size_t end, int *ref) {
+                            for (size_t idx = begin; idx < end; ++idx) {
+                                int i, j;
+                                ref[idx - begin] = !epi.q && view_index(idx, i, j) ? expected(idx, i, j, epi) : c_init(idx);
+                            }
+                        });
+                        if (epi.q) {
+                            VerifyReport q_report = verify_stream(q_parent, c_size, [&](size_t begin, size_t end, int8_t *ref) {
+                                for (size_t idx = begin; idx < end; ++idx) {
+                                    int i, j;
+                                    ref[idx - begin] = view_index(idx, i, j) ? expected_q(expected(idx, i, j, epi), epi) : 0;
+                                }
+                            });
+                            c_report.mismatches += q_report.mismatches;
+                            c_report.first_mismatch = std::min(c_report.first_mismatch, q_report.first_mismatch);
+                            c_report.max_ulps = std::max(c_report.max_ulps, q_report.max_ulps);
+                        }
+                        print_report(name, c_report);
+                    }
+                }
+                free(a_parent);
+                free(b_parent);
+                free(c_parent);
+                free(q_parent);
+            }
+        }
+    }
 }
 
 int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--freivalds")) {
+            use_freivalds = true;
+        } else if (!strcmp(argv[i], "--sub-devices") && i + 1 < argc) {
+            sub_device_units = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: %s [--freivalds] [--sub-devices COMPUTE_UNITS]\n", argv[0]);
+            return 1;
+        }
+    }
+    print_roof(host_roof<int>());
+    if (has_gpu())
+        print_roof(device_roof());
     matrix_test();
+    printf("------------------------------------------------\n");
+    xgemm_test();
     return 0;
 }
@@ -0,0 +1,226 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <omp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "chk.h"
+#include "protocol.h"
+#include "verify.h"
+
+// Test driver for the compute server. Each thread opens its own connection,
+// uploads operands once and then pipelines small GEMMs so that the server
+// can coalesce them; results are checked before the server stats are printed.
+
+struct Link {
+    int in_fd, out_fd;
+};
+
+Link connect_socket(const char *path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    CHK(fd >= 0);
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    CHK(strlen(path) < sizeof(addr.sun_path));
+    strcpy(addr.sun_path, path);
+    CHK(!connect(fd, (sockaddr *) &addr, sizeof(addr)));
+    return {fd, fd};
+}
+
+// Starts ./server in stdin mode with its stdin and stdout piped to us.
+Link spawn_server() {
+    int to_server[2], from_server[2];
+    CHK(!pipe(to_server));
+    CHK(!pipe(from_server));
+    pid_t pid = fork();
+    CHK(pid >= 0);
+    if (pid == 0) {
+        dup2(to_server[0], STDIN_FILENO);
+        dup2(from_server[1], STDOUT_FILENO);
+        close(to_server[1]);
+        close(from_server[0]);
+        execl("./server", "server", nullptr);
+        _exit(127);
+    }
+    close(to_server[0]);
+    close(from_server[1]);
+    return {from_server[0], to_server[1]};
+}
+
+void send_request(Link link, Request req, const void *payload = nullptr) {
+    CHK(write_full(link.out_fd, &req, sizeof(req)));
+    if (req.payload_bytes)
+        CHK(write_full(link.out_fd, payload, req.payload_bytes));
+}
+
+Response receive_response(Link link, std::vector<char> *payload = nullptr) {
+    Response res;
+    CHK(read_full(link.in_fd, &res, sizeof(res)));
+    std::vector<char> data(res.payload_bytes);
+    if (res.payload_bytes)
+        CHK(read_full(link.in_fd, data.data(), data.size()));
+    if (payload)
+        *payload = std::move(data);
+    return res;
+}
+
+uint64_t upload(Link link, uint32_t dtype, const void *data, size_t bytes) {
+    Request req = {};
+    req.op = OP_UPLOAD;
+    req.dtype = dtype;
+    req.payload_bytes = bytes;
+    send_request(link, req, data);
+    Response res = receive_response(link);
+    CHK(res.status == ST_OK);
+    return res.buffer;
+}
+
+std::vector<char> download(Link link, uint64_t id) {
+    Request req = {};
+    req.op = OP_DOWNLOAD;
+    req.buffers[0] = id;
+    send_request(link, req);
+    std::vector<char> data;
+    CHK(receive_response(link, &data).status == ST_OK);
+    return data;
+}
+
+bool axpy_job(Link link, size_t n, int incx, int incy) {
+    std::vector<float> x(n * incx), y(n * incy);
+    for (size_t i = 0; i < x.size(); ++i)
+        x[i] = .1f * (i % 10);
+    for (size_t i = 0; i < y.size(); ++i)
+        y[i] = .1f * (i % 10);
+    float a = .3f;
+    uint64_t x_id = upload(link, DT_F32, x.data(), x.size() * sizeof(float));
+    uint64_t y_id = upload(link, DT_F32, y.data(), y.size() * sizeof(float));
+
+    Request req = {};
+    req.op = OP_AXPY;
+    req.dtype = DT_F32;
+    req.buffers[0] = x_id;
+    req.buffers[1] = y_id;
+    req.dims[0] = n;
+    req.dims[1] = incx;
+    req.dims[2] = incy;
+    req.alpha = a;
+    send_request(link, req);
+    CHK(receive_response(link).status == ST_OK);
+
+    std::vector<char> result = download(link, y_id);
+    CHK(result.size() == y.size() * sizeof(float));
+    VerifyReport report = verify_stream((const float *) result.data(), y.size(), [&](size_t begin, size_t end, float *ref) {
+        for (size_t j = begin; j < end; ++j)
+            ref[j - begin] = j % incy == 0 ? y[j] + a * x[j / incy * incx] : y[j];
+    });
+    print_report("axpy", report);
+    return report.ok();
+}
+
+bool gemm_jobs(Link link, int jobs, int size, int thread) {
+    std::vector<int> a(size * size), b(size * size), c(size * size);
+    unsigned seed = thread + 1;
+    for (int &v : a)
+        v = rand_r(&seed) % 100;
+    for (int &v : b)
+        v = rand_r(&seed) % 100;
+    uint64_t ids[3] = {
+        upload(link, DT_I32, a.data(), a.size() * sizeof(int)),
+        upload(link, DT_I32, b.data(), b.size() * sizeof(int)),
+        upload(link, DT_I32, c.data(), c.size() * sizeof(int)),
+    };
+
+    // Pipelined: every request is on the wire before the first answer is read
+    Request req = {};
+    req.op = OP_GEMM;
+    req.dtype = DT_I32;
+    memcpy(req.buffers, ids, sizeof(ids));
+    req.dims[0] = req.dims[1] = req.dims[2] = size;
+    for (int i = 0; i < jobs; ++i) {
+        req.tag = i;
+        send_request(link, req);
+    }
+    bool ok = true;
+    for (int i = 0; i < jobs; ++i)
+        ok = receive_response(link).status == ST_OK && ok;
+
+    std::vector<char> result = download(link, ids[2]);
+    CHK(result.size() == c.size() * sizeof(int));
+    for (uint64_t id : ids) {
+        Request free_req = {};
+        free_req.op = OP_FREE;
+        free_req.buffers[0] = id;
+        send_request(link, free_req);
+        CHK(receive_response(link).status == ST_OK);
+    }
+    return ok && freivalds_check(a.data(), b.data(), (const int *) result.data(), size, size, size, size, size, size);
+}
+
+int main(int argc, char *argv[]) {
+    const char *socket_path = nullptr;
+    int threads = 4, jobs = 256, size = 32;
+    bool shutdown_server = false;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--socket") && i + 1 < argc) {
+            socket_path = argv[++i];
+        } else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--jobs") && i + 1 < argc) {
+            jobs = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--size") && i + 1 < argc) {
+            size = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--shutdown")) {
+            shutdown_server = true;
+        } else {
+            fprintf(stderr, "Usage: %s [--socket PATH] [--threads N] [--jobs N] [--size N] [--shutdown]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    // Without a socket the server is spawned on a pipe, which is one stream
+    Link control = socket_path ? connect_socket(socket_path) : spawn_server();
+    if (!socket_path)
+        threads = 1;
+
+    double start = omp_get_wtime();
+    std::vector<std::thread> workers;
+    std::vector<char> results(threads);
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            Link link = socket_path ? connect_socket(socket_path) : control;
+            results[t] = gemm_jobs(link, jobs, size, t);
+            if (socket_path)
+                close(link.in_fd);
+        });
+    }
+    for (std::thread &worker : workers)
+        worker.join();
+    double finish = omp_get_wtime();
+    printf("%d gemm jobs of size %d in %lf s (%.1lf jobs/s)\n", threads * jobs, size, finish - start,
+           threads * jobs / (finish - start));
+    for (int t = 0; t < threads; ++t) {
+        if (results[t])
+            printf("'gemm' verified on connection %d (Freivalds)\n", t);
+        else
+            printf("ERROR: 'gemm' wrong result on connection %d!!!\n", t);
+    }
+    CHK(axpy_job(control, 1 << 20, 3, 2));
+
+    Request req = {};
+    req.op = OP_STATS;
+    send_request(control, req);
+    std::vector<char> stats;
+    CHK(receive_response(control, &stats).status == ST_OK);
+    printf("%.*s", int(stats.size()), stats.data());
+
+    if (shutdown_server || !socket_path) {
+        req.op = OP_SHUTDOWN;
+        send_request(control, req);
+        receive_response(control);
+    }
+    return 0;
+}
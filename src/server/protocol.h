@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstddef>
+#include <unistd.h>
+
+// Wire format shared by the compute server and its client. Every request is a
+// fixed-size header optionally followed by `payload_bytes` of data, and is
+// answered by a Response header followed by its own payload. Both ends run on
+// the same host, so structs travel in native byte order.
+
+enum Op : uint32_t {
+    OP_UPLOAD = 1,  // payload -> new resident buffer, id returned in Response::buffer
+    OP_DOWNLOAD,    // buffers[0] -> payload
+    OP_FREE,        // buffers[0]
+    OP_AXPY,        // buffers[1] += alpha * buffers[0]; dims = {n, incx, incy}
+    OP_GEMM,        // buffers[2] = buffers[0] * buffers[1], C distinct from A and B; dims = {rows, inner, cols}
+    OP_STATS,       // latency and throughput report as text payload
+    OP_SHUTDOWN,
+};
+
+enum DType : uint32_t {
+    DT_F32 = 0,
+    DT_F64,
+    DT_I32,
+};
+
+inline size_t dtype_size(uint32_t dtype) {
+    return dtype == DT_F64 ? sizeof(double) : 4;
+}
+
+enum Status : int32_t {
+    ST_OK = 0,
+    ST_BAD_REQUEST,
+    ST_UNKNOWN_BUFFER,
+    ST_SHUTTING_DOWN,  // arrived after a shutdown request, not executed
+};
+
+struct Request {
+    uint32_t op;
+    uint32_t dtype;
+    uint64_t tag;  // echoed back in the response
+    uint64_t buffers[3];
+    int64_t dims[3];
+    double alpha;
+    uint64_t payload_bytes;
+};
+
+struct Response {
+    uint64_t tag;
+    int32_t status;
+    uint32_t reserved;
+    uint64_t buffer;
+    uint64_t payload_bytes;
+};
+
+inline bool read_full(int fd, void *data, size_t size) {
+    char *p = (char *) data;
+    while (size) {
+        ssize_t got = read(fd, p, size);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return false;
+        p += got;
+        size -= got;
+    }
+    return true;
+}
+
+inline bool write_full(int fd, const void *data, size_t size) {
+    const char *p = (const char *) data;
+    while (size) {
+        ssize_t put = write(fd, p, size);
+        if (put < 0 && errno == EINTR)
+            continue;
+        if (put <= 0)
+            return false;
+        p += put;
+        size -= put;
+    }
+    return true;
+}
@@ -0,0 +1,533 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <CL/cl.h>
+#include "chk.h"
+#include "cl_env.h"
+#include "kernel_cache.h"
+#include "protocol.h"
+
+// Long-running compute server: OpenCL is initialized and the programs are
+// built once, operands stay resident on the device between requests, and
+// small same-shaped GEMMs that arrive together are launched as one batch.
+// Requests come from stdin (responses go to stdout) or from a Unix socket.
+
+using Clock = std::chrono::steady_clock;
+
+constexpr int BLOCK_SIZE = 16;
+constexpr size_t AXPY_WORKGROUP_SIZE = 256;
+constexpr uint64_t MAX_PAYLOAD = 1ull << 32;
+
+const char *op_names[] = {"", "upload", "download", "free", "axpy", "gemm", "stats", "shutdown"};
+constexpr int OP_COUNT = sizeof(op_names) / sizeof(op_names[0]);
+
+struct Options {
+    const char *socket_path = nullptr;
+    int coalesce_us = 200;
+    size_t max_batch = 64;
+    int64_t small_gemm = 256 * 256 * 256;
+};
+
+struct Connection {
+    int in_fd, out_fd;
+    bool owned;
+    std::mutex writing;  // the worker and a rejecting reader may both answer
+
+    Connection(int in_fd, int out_fd, bool owned) : in_fd(in_fd), out_fd(out_fd), owned(owned) {}
+
+    ~Connection() {
+        if (owned)
+            close(in_fd);
+    }
+};
+
+struct Job {
+    Request req;
+    std::vector<char> payload;
+    std::shared_ptr<Connection> conn;
+    Clock::time_point received;
+};
+
+struct Resident {
+    cl_mem mem;
+    uint32_t dtype;
+    size_t count;
+};
+
+size_t round_up(size_t x, size_t to) {
+    return (x + to - 1) / to * to;
+}
+
+void send_response(Connection &conn, const Request &req, int32_t status, uint64_t buffer = 0, const void *payload = nullptr,
+                   size_t payload_bytes = 0) {
+    Response res = {req.tag, status, 0, buffer, payload_bytes};
+    std::lock_guard<std::mutex> lock(conn.writing);
+    if (!write_full(conn.out_fd, &res, sizeof(res)) || (payload_bytes && !write_full(conn.out_fd, payload, payload_bytes)))
+        fprintf(stderr, "Failed to answer request %llu\n", (unsigned long long) req.tag);
+}
+
+class Server {
+public:
+    std::function<void()> on_shutdown;
+
+    explicit Server(const Options &options)
+        : options(options),
+          axpy_kernels(cl_env().context, cl_env().device, "../lab2/lab2.cl"),
+          gemm_kernels(cl_env().context, cl_env().device, "../lab3/lab3.cl") {
+        axpy_kernels.get("saxpy_gpu");
+        axpy_kernels.get("daxpy_gpu");
+        gemm_kernels.get("matrix_multiply_batched");
+        start = Clock::now();
+    }
+
+    ~Server() {
+        for (auto &[id, buffer] : residents)
+            clReleaseMemObject(buffer.mem);
+        for (cl_mem mem : staging)
+            if (mem)
+                clReleaseMemObject(mem);
+    }
+
+    // Once stopping, the worker may already be gone, so late requests are
+    // answered here instead of being queued.
+    void submit(Job job) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!stopping) {
+                queue.push_back(std::move(job));
+                cv.notify_one();
+                return;
+            }
+        }
+        send_response(*job.conn, job.req, ST_SHUTTING_DOWN);
+    }
+
+    // The worker exits once everything already queued has been served.
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_one();
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            cv.wait(lock, [&] { return !queue.empty() || stopping; });
+            if (queue.empty())
+                break;
+            Clock::time_point busy_start = Clock::now();
+            std::vector<Job> batch;
+            batch.push_back(std::move(queue.front()));
+            queue.pop_front();
+            if (batch[0].req.op == OP_GEMM && is_small(batch[0].req)) {
+                auto deadline = Clock::now() + std::chrono::microseconds(options.coalesce_us);
+                while (batch.size() < options.max_batch) {
+                    if (queue.empty() && (stopping || !cv.wait_until(lock, deadline, [&] { return !queue.empty() || stopping; })))
+                        break;
+                    if (queue.empty() || !can_join(batch, queue.front()))
+                        break;
+                    batch.push_back(std::move(queue.front()));
+                    queue.pop_front();
+                }
+            }
+            lock.unlock();
+            if (batch[0].req.op == OP_GEMM)
+                run_gemm(batch);
+            else
+                execute(batch[0]);
+            lock.lock();
+            busy += Clock::now() - busy_start;
+        }
+    }
+
+    std::string stats() const {
+        double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+        double busy_seconds = std::chrono::duration<double>(busy).count();
+        size_t total = 0;
+        for (const auto &samples : latencies)
+            total += samples.size();
+        char line[256];
+        std::string report;
+        // Idle time between requests says nothing about the rate under load
+        snprintf(line, sizeof(line), "requests: %zu, elapsed: %.3lf s, busy: %.3lf s, throughput: %.1lf req/s while busy\n",
+                 total, elapsed, busy_seconds, busy_seconds > 0 ? total / busy_seconds : 0.0);
+        report += line;
+        snprintf(line, sizeof(line), "gemm launches: %zu, gemm jobs: %zu, avg batch: %.2lf\n",
+                 gemm_launches, gemm_jobs, gemm_launches ? double(gemm_jobs) / gemm_launches : 0.0);
+        report += line;
+        snprintf(line, sizeof(line), "%-10s %8s %10s %10s %10s %10s\n", "op", "count", "p50 us", "p90 us", "p99 us", "max us");
+        report += line;
+        for (int op = 1; op < OP_COUNT; ++op) {
+            if (latencies[op].empty())
+                continue;
+            std::vector<double> sorted = latencies[op];
+            std::sort(sorted.begin(), sorted.end());
+            auto percentile = [&](double p) {
+                size_t rank = size_t(p * sorted.size() + 0.999999);
+                return sorted[std::clamp<size_t>(rank, 1, sorted.size()) - 1];
+            };
+            snprintf(line, sizeof(line), "%-10s %8zu %10.1lf %10.1lf %10.1lf %10.1lf\n", op_names[op], sorted.size(),
+                     percentile(.5), percentile(.9), percentile(.99), sorted.back());
+            report += line;
+        }
+        return report;
+    }
+
+private:
+    Options options;
+    KernelCache axpy_kernels;
+    KernelCache gemm_kernels;
+    std::map<uint64_t, Resident> residents;
+    uint64_t next_id = 1;
+    // Packed A, B and C operands of coalesced GEMMs, grown on demand
+    cl_mem staging[3] = {};
+    size_t staging_bytes[3] = {};
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<Job> queue;
+    bool stopping = false;
+
+    Clock::time_point start;
+    Clock::duration busy{};  // spent by the worker on batches, coalescing included
+    std::vector<double> latencies[OP_COUNT];
+    size_t gemm_launches = 0;
+    size_t gemm_jobs = 0;
+
+    // Each dim must fit the kernel's int arguments; with that bound the
+    // pairwise products below cannot overflow int64.
+    static bool gemm_shape_valid(const Request &req) {
+        for (int64_t dim : req.dims) {
+            if (dim <= 0 || dim > INT32_MAX)
+                return false;
+        }
+        return true;
+    }
+
+    bool is_small(const Request &req) const {
+        return gemm_shape_valid(req) && req.dims[0] * req.dims[1] <= options.small_gemm / req.dims[2];
+    }
+
+    // Only consecutive GEMMs of one shape are batched, and none may read a
+    // matrix written earlier in the batch, so the result matches serial order.
+    bool can_join(const std::vector<Job> &batch, const Job &job) const {
+        const Request &req = job.req;
+        if (req.op != OP_GEMM || memcmp(req.dims, batch[0].req.dims, sizeof(req.dims)))
+            return false;
+        for (const Job &member : batch) {
+            if (member.req.buffers[2] == req.buffers[0] || member.req.buffers[2] == req.buffers[1])
+                return false;
+        }
+        return true;
+    }
+
+    void respond(const Job &job, int32_t status, uint64_t buffer = 0, const void *payload = nullptr, size_t payload_bytes = 0) {
+        send_response(*job.conn, job.req, status, buffer, payload, payload_bytes);
+        double us = std::chrono::duration<double, std::micro>(Clock::now() - job.received).count();
+        latencies[job.req.op < OP_COUNT ? job.req.op : 0].push_back(us);
+    }
+
+    Resident *find(uint64_t id) {
+        auto it = residents.find(id);
+        return it == residents.end() ? nullptr : &it->second;
+    }
+
+    void execute(Job &job) {
+        const Request &req = job.req;
+        ClEnv &env = cl_env();
+        switch (req.op) {
+        case OP_UPLOAD: {
+            size_t elem = dtype_size(req.dtype);
+            if (req.dtype > DT_I32 || req.payload_bytes == 0 || req.payload_bytes % elem) {
+                respond(job, ST_BAD_REQUEST);
+                return;
+            }
+            cl_mem mem = clCreateBuffer(env.context, CL_MEM_READ_WRITE, req.payload_bytes, nullptr, nullptr);
+            CHK(mem);
+            CHK(!clEnqueueWriteBuffer(env.queue, mem, CL_TRUE, 0, req.payload_bytes, job.payload.data(), 0, nullptr, nullptr));
+            uint64_t id = next_id++;
+            residents[id] = {mem, req.dtype, req.payload_bytes / elem};
+            respond(job, ST_OK, id);
+            return;
+        }
+        case OP_DOWNLOAD: {
+            Resident *buffer = find(req.buffers[0]);
+            if (!buffer) {
+                respond(job, ST_UNKNOWN_BUFFER);
+                return;
+            }
+            std::vector<char> data(buffer->count * dtype_size(buffer->dtype));
+            CHK(!clEnqueueReadBuffer(env.queue, buffer->mem, CL_TRUE, 0, data.size(), data.data(), 0, nullptr, nullptr));
+            respond(job, ST_OK, req.buffers[0], data.data(), data.size());
+            return;
+        }
+        case OP_FREE: {
+            Resident *buffer = find(req.buffers[0]);
+            if (!buffer) {
+                respond(job, ST_UNKNOWN_BUFFER);
+                return;
+            }
+            CHK(!clReleaseMemObject(buffer->mem));
+            residents.erase(req.buffers[0]);
+            respond(job, ST_OK);
+            return;
+        }
+        case OP_AXPY:
+            run_axpy(job);
+            return;
+        case OP_STATS: {
+            std::string report = stats();
+            respond(job, ST_OK, 0, report.data(), report.size());
+            return;
+        }
+        case OP_SHUTDOWN:
+            respond(job, ST_OK);
+            stop();
+            if (on_shutdown)
+                on_shutdown();
+            return;
+        default:
+            respond(job, ST_BAD_REQUEST);
+        }
+    }
+
+    void run_axpy(Job &job) {
+        const Request &req = job.req;
+        ClEnv &env = cl_env();
+        Resident *x = find(req.buffers[0]), *y = find(req.buffers[1]);
+        if (!x || !y) {
+            respond(job, ST_UNKNOWN_BUFFER);
+            return;
+        }
+        int64_t n = req.dims[0], incx = req.dims[1], incy = req.dims[2];
+        // Every value must fit the kernel's int arguments, and the last
+        // element is bounds-checked by division so nothing is multiplied
+        // before it is known to fit
+        if (x->dtype != y->dtype || x->dtype == DT_I32 || n <= 0 || n > INT32_MAX || incx <= 0 || incx > INT32_MAX ||
+            incy <= 0 || incy > INT32_MAX || size_t(n - 1) > (x->count - 1) / incx || size_t(n - 1) > (y->count - 1) / incy) {
+            respond(job, ST_BAD_REQUEST);
+            return;
+        }
+        cl_kernel kernel = axpy_kernels.get(x->dtype == DT_F32 ? "saxpy_gpu" : "daxpy_gpu");
+        int n_arg = n, incx_arg = incx, incy_arg = incy;
+        float a_float = req.alpha;
+        CHK(!clSetKernelArg(kernel, 0, sizeof(int), &n_arg));
+        if (x->dtype == DT_F32) {
+            CHK(!clSetKernelArg(kernel, 1, sizeof(float), &a_float));
+        } else {
+            CHK(!clSetKernelArg(kernel, 1, sizeof(double), &req.alpha));
+        }
+        CHK(!clSetKernelArg(kernel, 2, sizeof(cl_mem), &x->mem));
+        CHK(!clSetKernelArg(kernel, 3, sizeof(int), &incx_arg));
+        CHK(!clSetKernelArg(kernel, 4, sizeof(cl_mem), &y->mem));
+        CHK(!clSetKernelArg(kernel, 5, sizeof(int), &incy_arg));
+        size_t global_work_size = round_up(n, AXPY_WORKGROUP_SIZE);
+        size_t workgroup_size = AXPY_WORKGROUP_SIZE;
+        CHK(!clEnqueueNDRangeKernel(env.queue, kernel, 1, nullptr, &global_work_size, &workgroup_size, 0, nullptr, nullptr));
+        CHK(!clFinish(env.queue));
+        respond(job, ST_OK);
+    }
+
+    cl_mem staging_buffer(int which, size_t bytes) {
+        if (staging_bytes[which] < bytes) {
+            if (staging[which]) {
+                CHK(!clReleaseMemObject(staging[which]));
+            }
+            staging[which] = clCreateBuffer(cl_env().context, CL_MEM_READ_WRITE, bytes, nullptr, nullptr);
+            CHK(staging[which]);
+            staging_bytes[which] = bytes;
+        }
+        return staging[which];
+    }
+
+    void run_gemm(std::vector<Job> &jobs) {
+        int64_t rows = jobs[0].req.dims[0], inner = jobs[0].req.dims[1], cols = jobs[0].req.dims[2];
+        bool shape_valid = gemm_shape_valid(jobs[0].req);
+        size_t sizes[3] = {};
+        if (shape_valid) {
+            sizes[0] = rows * inner;
+            sizes[1] = inner * cols;
+            sizes[2] = rows * cols;
+        }
+        std::vector<Job *> batch;
+        std::vector<Resident *> operands;
+        for (Job &job : jobs) {
+            Resident *ops[3];
+            // The kernel writes C while other work-items still read A and B,
+            // so C must be a buffer of its own, batched or not
+            const uint64_t *ids = job.req.buffers;
+            bool known = true, valid = shape_valid && ids[2] != ids[0] && ids[2] != ids[1];
+            for (int i = 0; i < 3; ++i) {
+                ops[i] = find(job.req.buffers[i]);
+                known = known && ops[i];
+                valid = valid && ops[i] && ops[i]->dtype == DT_I32 && ops[i]->count >= sizes[i];
+            }
+            if (!known || !valid) {
+                respond(job, known ? ST_BAD_REQUEST : ST_UNKNOWN_BUFFER);
+                continue;
+            }
+            batch.push_back(&job);
+            operands.insert(operands.end(), ops, ops + 3);
+        }
+        if (batch.empty())
+            return;
+
+        ClEnv &env = cl_env();
+        cl_mem mems[3];
+        if (batch.size() == 1) {
+            for (int i = 0; i < 3; ++i)
+                mems[i] = operands[i]->mem;
+        } else {
+            for (int i = 0; i < 3; ++i)
+                mems[i] = staging_buffer(i, batch.size() * sizes[i] * sizeof(int));
+            for (size_t j = 0; j < batch.size(); ++j) {
+                for (int i = 0; i < 2; ++i) {
+                    CHK(!clEnqueueCopyBuffer(env.queue, operands[j * 3 + i]->mem, mems[i], 0, j * sizes[i] * sizeof(int),
+                                             sizes[i] * sizeof(int), 0, nullptr, nullptr));
+                }
+            }
+        }
+
+        cl_kernel kernel = gemm_kernels.get("matrix_multiply_batched");
+        int rows_arg = rows, inner_arg = inner, cols_arg = cols;
+        CHK(!clSetKernelArg(kernel, 0, sizeof(cl_mem), &mems[0]));
+        CHK(!clSetKernelArg(kernel, 1, sizeof(cl_mem), &mems[1]));
+        CHK(!clSetKernelArg(kernel, 2, sizeof(cl_mem), &mems[2]));
+        CHK(!clSetKernelArg(kernel, 3, sizeof(int), &rows_arg));
+        CHK(!clSetKernelArg(kernel, 4, sizeof(int), &inner_arg));
+        CHK(!clSetKernelArg(kernel, 5, sizeof(int), &cols_arg));
+        const size_t global_work_size[3] = {round_up(cols, BLOCK_SIZE), round_up(rows, BLOCK_SIZE), batch.size()};
+        const size_t local_work_size[3] = {BLOCK_SIZE, BLOCK_SIZE, 1};
+        CHK(!clEnqueueNDRangeKernel(env.queue, kernel, 3, nullptr, global_work_size, local_work_size, 0, nullptr, nullptr));
+
+        if (batch.size() > 1) {
+            for (size_t j = 0; j < batch.size(); ++j) {
+                CHK(!clEnqueueCopyBuffer(env.queue, mems[2], operands[j * 3 + 2]->mem, j * sizes[2] * sizeof(int), 0,
+                                         sizes[2] * sizeof(int), 0, nullptr, nullptr));
+            }
+        }
+        CHK(!clFinish(env.queue));
+
+        ++gemm_launches;
+        gemm_jobs += batch.size();
+        for (Job *job : batch)
+            respond(*job, ST_OK);
+    }
+};
+
+void read_requests(Server &server, std::shared_ptr<Connection> conn) {
+    Job job;
+    while (read_full(conn->in_fd, &job.req, sizeof(job.req))) {
+        if (job.req.payload_bytes > MAX_PAYLOAD) {
+            fprintf(stderr, "Request %llu is too large, dropping connection\n", (unsigned long long) job.req.tag);
+            return;
+        }
+        job.payload.resize(job.req.payload_bytes);
+        if (job.req.payload_bytes && !read_full(conn->in_fd, job.payload.data(), job.payload.size()))
+            return;
+        job.conn = conn;
+        job.received = Clock::now();
+        server.submit(std::move(job));
+        job = Job();
+    }
+}
+
+int serve_socket(Server &server, std::thread &worker, const char *path) {
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    CHK(listen_fd >= 0);
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    CHK(strlen(path) < sizeof(addr.sun_path));
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    CHK(!bind(listen_fd, (sockaddr *) &addr, sizeof(addr)));
+    CHK(!listen(listen_fd, 64));
+    server.on_shutdown = [listen_fd] { shutdown(listen_fd, SHUT_RDWR); };
+    fprintf(stderr, "Listening on %s\n", path);
+
+    // Readers hold the server, so they are all joined before it goes away.
+    // One whose connection nobody else holds any more has returned.
+    struct Reader {
+        std::thread thread;
+        std::shared_ptr<Connection> conn;
+    };
+    std::list<Reader> readers;
+    auto reap = [&] {
+        for (auto it = readers.begin(); it != readers.end();) {
+            if (it->conn.use_count() > 1) {
+                ++it;
+                continue;
+            }
+            it->thread.join();
+            it = readers.erase(it);
+        }
+    };
+
+    while (true) {
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        reap();
+        auto conn = std::make_shared<Connection>(fd, fd, true);
+        readers.push_back({std::thread(read_requests, std::ref(server), conn), conn});
+    }
+    worker.join();
+    // The queue is drained; wake the readers still blocked on their clients
+    for (Reader &reader : readers) {
+        shutdown(reader.conn->in_fd, SHUT_RDWR);
+        reader.thread.join();
+    }
+    close(listen_fd);
+    unlink(path);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--socket") && i + 1 < argc) {
+            options.socket_path = argv[++i];
+        } else if (!strcmp(argv[i], "--coalesce-us") && i + 1 < argc) {
+            options.coalesce_us = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--max-batch") && i + 1 < argc) {
+            options.max_batch = std::max(1, atoi(argv[++i]));
+        } else {
+            fprintf(stderr, "Usage: %s [--socket PATH] [--coalesce-us N] [--max-batch N]\n", argv[0]);
+            return 1;
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    Server server(options);
+    fprintf(stderr, "Programs built, ready\n");
+    std::thread worker([&] { server.run(); });
+    if (options.socket_path) {
+        serve_socket(server, worker, options.socket_path);
+    } else {
+        read_requests(server, std::make_shared<Connection>(STDIN_FILENO, STDOUT_FILENO, false));
+        server.stop();
+        worker.join();
+    }
+    fprintf(stderr, "%s", server.stats().c_str());
+    return 0;
+}